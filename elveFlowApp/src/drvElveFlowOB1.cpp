@@ -6,29 +6,95 @@
  * set pressure
  * read pressure
  * read sensor
+ * acquisition thread: all channels are read every poll period
+ * volume totalizer and dispense-to-target dosing
+ * flow settled detector
+ * running statistics of pressure and flow over two configurable windows
+ * spectral noise analysis (PSD) on a low priority thread
+ * system identification with step or chirp excitation
+ * PI flow regulator with relay auto-tuning
+ * decoupled multi-channel (MIMO) flow control
+ * Smith predictor dead time compensation in the flow regulator
+ * feed-forward of flow setpoint changes from a learned pressure to flow model
+ * time-tagged command queue executed by the acquisition thread
+ * step sequencer (pressure, ramp, wait for flow or time, trigger, loop)
+ * slew rate and acceleration limited (S-curve) pressure setpoint changes
+ * shared memory export of every acquired sample (elveFlowShm.h)
+ * multi-resolution history (raw, per second, per minute) for trend displays
+ * channel enable mask, disabled channels are neither acquired nor published
+ * digital flow sensors read on their own thread, with selectable resolution
+ * detection of digital sensor resets, the sensor is added again at once
+ * sensor configuration cache, applied in one pass when the IOC is running
+ * H2O/IPA sensor calibration and user flow correction curves (elveFlowCorrection.h)
+ * bumpless restart of all channels, control state checkpointed to a file (elveFlowCheckpoint.h)
+ * controllers initialized in parallel, joined before iocInit, startup timing report
+ * OB1_Calib on a worker thread, the new calibration replaces the live one when done
+ * group port over several OB1s, synchronized cycles with a common timestamp
+ * acquisition of all ports aligned to common clock ticks, inter-controller skew published
+ * I/O thread priority and CPU affinity per controller, cycle start jitter published
  * ...
  *
  * Oksana Ivashkevych 
  * March 2019
 */
 
+#include <math.h>
+#include <string.h>
+
 #include <iocsh.h>
 #include <asynPortDriver.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsMath.h>
+#include <alarm.h>
 
 #include <Elveflow64.h>
 
+#include "elveFlowStats.h"
+#include "elveFlowSpectrum.h"
+#include "elveFlowSysId.h"
+#include "elveFlowShm.h"
+#include "elveFlowHistory.h"
+#include "elveFlowCorrection.h"
+#include "elveFlowCheckpoint.h"
+#include "elveFlowThread.h"
+
 #include <epicsExport.h>
 #include <epicsExit.h>
+#include <initHooks.h>
 #include <iostream>   //if want to use cout
 using namespace std;  //f want to use cout
 
 // Forward function definitions
 static void exitCallbackC(void *drvPvt);
+static void pollerThreadC(void *drvPvt);
+static void analysisThreadC(void *drvPvt);
+static void digitalThreadC(void *drvPvt);
+static void initThreadC(void *drvPvt);
+static void calibThreadC(void *drvPvt);
+static void groupExitCallbackC(void *drvPvt);
+static void groupThreadC(void *drvPvt);
 
 static const char *driverName = "USBelveFlow";
 
 //Sensor type parameters
 #define EFSensorTypeString        "EF_Z_SENSOR_TYPE"
+#define EFSensorKindString        "EF_SENSOR_KIND"
+#define EFSensorResolutionString  "EF_SENSOR_RESOLUTION"
+#define EFSensorJumpString        "EF_SENSOR_JUMP"
+#define EFSensorValidString       "EF_SENSOR_VALID"
+#define EFSensorResetsString      "EF_SENSOR_RESETS"
+#define EFSensorCalibString       "EF_SENSOR_CALIB"
+#define EFFlowRawString           "EF_FLOW_RAW"
+#define EFCorrModeString          "EF_CORR_MODE"
+#define EFCorrXString             "EF_CORR_X"
+#define EFCorrYString             "EF_CORR_Y"
+#define EFCorrCoefsString         "EF_CORR_COEFS"
+#define EFCorrValidString         "EF_CORR_VALID"
 
 // Analog output parameters, set Frequency of measurements up t0 100 Hz.
 #define EFSetPressureString      "EF_SET_PRESSURE" 
@@ -37,60 +103,1359 @@ static const char *driverName = "USBelveFlow";
 #define EFReadPressureString      "EF_GET_PRESSURE"
 #define EFReadFlowSting           "EF_GET_FLOW"
 
+// Acquisition parameters
+#define EFPollPeriodString        "EF_POLL_PERIOD"
+#define EFDigitalPeriodString     "EF_DIGITAL_PERIOD"
+#define EFAnalogRateString        "EF_ANALOG_RATE"
+#define EFDigitalRateString       "EF_DIGITAL_RATE"
+#define EFTickAlignString         "EF_TICK_ALIGN"
+#define EFTickOffsetString        "EF_TICK_OFFSET"
+#define EFTickSkewString          "EF_TICK_SKEW"
+#define EFTickPortsString         "EF_TICK_PORTS"
+#define EFCycleJitterString       "EF_CYCLE_JITTER"
+#define EFCycleLateMaxString      "EF_CYCLE_LATE_MAX"
+
+// Volume totalizer and dosing parameters
+#define EFVolumeString            "EF_VOLUME"
+#define EFVolumeResetString       "EF_VOLUME_RESET"
+#define EFDosePressureString      "EF_DOSE_PRESSURE"
+#define EFDoseTargetString        "EF_DOSE_TARGET"
+#define EFDoseRampString          "EF_DOSE_RAMP"
+#define EFDoseStartString         "EF_DOSE_START"
+#define EFDoseStateString         "EF_DOSE_STATE"
+#define EFDoseVolumeString        "EF_DOSE_VOLUME"
+
+// Flow settled detector parameters
+#define EFSettleTolString         "EF_SETTLE_TOL"
+#define EFSettleWindowString      "EF_SETTLE_WINDOW"
+#define EFSettledString           "EF_SETTLED"
+#define EFSettleTimeString        "EF_SETTLE_TIME"
+#define EFFlowMeanString          "EF_FLOW_MEAN"
+#define EFFlowStddevString        "EF_FLOW_STDDEV"
+
+// Running statistics parameters, N is the window number 1..NUM_STATS_WINDOWS
+#define EFStatsPeriodString       "EF_STATS%d_PERIOD"
+#define EFStatsCountString        "EF_STATS%d_COUNT"
+#define EFStatsMeanString         "EF_STATS%d_%s_MEAN"
+#define EFStatsStddevString       "EF_STATS%d_%s_STDDEV"
+#define EFStatsMinString          "EF_STATS%d_%s_MIN"
+#define EFStatsMaxString          "EF_STATS%d_%s_MAX"
+
+// Spectral analysis parameters
+#define EFPsdEnableString         "EF_PSD_ENABLE"
+#define EFPsdLengthString         "EF_PSD_LENGTH"
+#define EFPsdIntervalString       "EF_PSD_INTERVAL"
+#define EFPsdRateString           "EF_PSD_RATE"
+#define EFPsdFreqString           "EF_PSD_FREQ"
+#define EFPsdPressString          "EF_PSD_PRESS"
+#define EFPsdFlowString           "EF_PSD_FLOW"
+#define EFPsdPressPeakString      "EF_PSD_PRESS_PEAK"
+#define EFPsdFlowPeakString       "EF_PSD_FLOW_PEAK"
+#define EFPsdPressRmsString       "EF_PSD_PRESS_RMS"
+#define EFPsdFlowRmsString        "EF_PSD_FLOW_RMS"
+
+// System identification parameters
+#define EFSysIdModeString         "EF_SYSID_MODE"
+#define EFSysIdBaseString         "EF_SYSID_BASE"
+#define EFSysIdAmplString         "EF_SYSID_AMPL"
+#define EFSysIdDurationString     "EF_SYSID_DURATION"
+#define EFSysIdF0String           "EF_SYSID_F0"
+#define EFSysIdF1String           "EF_SYSID_F1"
+#define EFSysIdStartString        "EF_SYSID_START"
+#define EFSysIdStateString        "EF_SYSID_STATE"
+#define EFSysIdGainString         "EF_SYSID_GAIN"
+#define EFSysIdDeadTimeString     "EF_SYSID_DEADTIME"
+#define EFSysIdTauString          "EF_SYSID_TAU"
+#define EFSysIdFreqString         "EF_SYSID_FREQ"
+#define EFSysIdMagString          "EF_SYSID_MAG"
+#define EFSysIdPhaseString        "EF_SYSID_PHASE"
+#define EFSysIdTimeDataString     "EF_SYSID_TIME_DATA"
+#define EFSysIdSetpointDataString "EF_SYSID_SETPOINT_DATA"
+#define EFSysIdFlowDataString     "EF_SYSID_FLOW_DATA"
+
+// Flow regulator parameters
+#define EFRegEnableString         "EF_REG_ENABLE"
+#define EFFlowSetpointString      "EF_FLOW_SETPOINT"
+#define EFRegKpString             "EF_REG_KP"
+#define EFRegKiString             "EF_REG_KI"
+#define EFRegOutMinString         "EF_REG_OUT_MIN"
+#define EFRegOutMaxString         "EF_REG_OUT_MAX"
+
+// Relay auto-tuning parameters
+#define EFTuneStartString         "EF_TUNE_START"
+#define EFTuneStateString         "EF_TUNE_STATE"
+#define EFTuneAmplString          "EF_TUNE_AMPL"
+#define EFTuneHystString          "EF_TUNE_HYST"
+#define EFTuneCyclesString        "EF_TUNE_CYCLES"
+#define EFTuneTimeoutString       "EF_TUNE_TIMEOUT"
+#define EFTuneKuString            "EF_TUNE_KU"
+#define EFTunePuString            "EF_TUNE_PU"
+
+// Decoupled multi-channel control parameters
+#define EFMimoEnableString        "EF_MIMO_ENABLE"
+#define EFMimoMatrixString        "EF_MIMO_MATRIX"
+#define EFMimoStatusString        "EF_MIMO_STATUS"
+
+// Process model and Smith predictor parameters
+#define EFModelGainString         "EF_MODEL_GAIN"
+#define EFModelTauString          "EF_MODEL_TAU"
+#define EFModelDeadTimeString     "EF_MODEL_DEADTIME"
+#define EFSmithEnableString       "EF_SMITH_ENABLE"
+#define EFRegFeedbackString       "EF_REG_FEEDBACK"
+
+// Feed-forward parameters
+#define EFFfEnableString          "EF_FF_ENABLE"
+#define EFFfForgetString          "EF_FF_FORGET"
+#define EFFfResetString           "EF_FF_RESET"
+#define EFFfSlopeString           "EF_FF_SLOPE"
+#define EFFfOffsetString          "EF_FF_OFFSET"
+#define EFFfSamplesString         "EF_FF_SAMPLES"
+#define EFFfPressureString        "EF_FF_PRESSURE"
+
+// Time-tagged command queue parameters
+#define EFCmdQueueString          "EF_CMD_QUEUE"
+#define EFCmdClearString          "EF_CMD_CLEAR"
+#define EFCmdPendingString        "EF_CMD_PENDING"
+#define EFCmdLastIdString         "EF_CMD_LAST_ID"
+#define EFCmdLastTimeString       "EF_CMD_LAST_TIME"
+#define EFCmdLastLatenessString   "EF_CMD_LAST_LATENESS"
+#define EFCmdLogIdString          "EF_CMD_LOG_ID"
+#define EFCmdLogTimeString        "EF_CMD_LOG_TIME"
+#define EFCmdLogLatenessString    "EF_CMD_LOG_LATENESS"
+
+// Sequencer parameters
+#define EFSeqProgramString        "EF_SEQ_PROGRAM"
+#define EFSeqMessageString        "EF_SEQ_MESSAGE"
+#define EFSeqLengthString         "EF_SEQ_LENGTH"
+#define EFSeqStartString          "EF_SEQ_START"
+#define EFSeqStateString          "EF_SEQ_STATE"
+#define EFSeqStepString           "EF_SEQ_STEP"
+#define EFSeqStepTimeString       "EF_SEQ_STEP_TIME"
+#define EFSeqStepTimesString      "EF_SEQ_STEP_TIMES"
+
+// Setpoint ramp parameters
+#define EFSlewRateString          "EF_SLEW_RATE"
+#define EFSlewAccelString         "EF_SLEW_ACCEL"
+#define EFRampActiveString        "EF_RAMP_ACTIVE"
+#define EFRampProgressString      "EF_RAMP_PROGRESS"
+#define EFSetpointString          "EF_SETPOINT"
+
+// Shared memory export parameters
+#define EFShmNameString           "EF_SHM_NAME"
+#define EFShmCountString          "EF_SHM_COUNT"
+
+// History query parameters
+#define EFHistSpanString          "EF_HIST_SPAN"
+#define EFHistPointsString        "EF_HIST_POINTS"
+#define EFHistQueryString         "EF_HIST_QUERY"
+#define EFHistTimeString          "EF_HIST_TIME"
+#define EFHistMinString           "EF_HIST_%s_MIN"
+#define EFHistMeanString          "EF_HIST_%s_MEAN"
+#define EFHistMaxString           "EF_HIST_%s_MAX"
+
+// Channel enable parameters
+#define EFChannelMaskString       "EF_CHANNEL_MASK"
+#define EFChannelEnabledString    "EF_CHANNEL_ENABLED"
+
+//Pressure calibration (OB1_Calib)
+#define EFCalibStartString        "EF_CALIB_START"
+#define EFCalibStateString        "EF_CALIB_STATE"
+#define EFCalibProgressString     "EF_CALIB_PROGRESS"
+#define EFCalibElapsedString      "EF_CALIB_ELAPSED"
+#define EFCalibDurationString     "EF_CALIB_DURATION"
+#define EFCalibSaveString         "EF_CALIB_SAVE"
+#define EFCalibFileString         "EF_CALIB_FILE"
+#define EFCalibMessageString      "EF_CALIB_MESSAGE"
+
+// Group port parameters, on address 0 of a USBelveFlowGroup
+#define EFGroupTimeString         "EF_GROUP_TIME"
+#define EFGroupPressureString     "EF_GROUP_PRESSURE"
+#define EFGroupFlowString         "EF_GROUP_FLOW"
+#define EFGroupSetpointString     "EF_GROUP_SETPOINT"
+#define EFGroupSetAllString       "EF_GROUP_SET_ALL"
+#define EFGroupSpreadString       "EF_GROUP_SPREAD"
+#define EFGroupCycleTimeString    "EF_GROUP_CYCLE_TIME"
+
 //This is a multidevice with 4 identical channels
 #define MAX_SIGNALS 4
 
+//Controllers in one group port, its addresses are 0..4*members-1
+#define MAX_GROUP_MEMBERS 4
+
+//Length of the calibration array, 1000 is always enough
+#define CALIB_LEN 1000
+
+//Expected OB1_Calib duration for the progress estimate until one was measured, s
+#define DEFAULT_CALIB_DURATION 300.0
+
+//Default acquisition period in seconds, OB1 can be read at up to 100 Hz
+#define DEFAULT_POLL_PERIOD 0.01
+
+//Default period of the digital sensor thread. Digital sensors use a slower
+//protocol, the achievable rate depends on their resolution.
+#define DEFAULT_DIGITAL_PERIOD 0.02
+
+//A suspicious digital sensor value (exact zero or jump) that repeats this
+//many times is taken as real. Read errors are never accepted, the sensor
+//is added again every SENSOR_RETRY_CYCLES while they last.
+#define SENSOR_MAX_HOLD 3
+#define SENSOR_RETRY_CYCLES 50
+
+//Number of independent statistics windows, e.g. 1 s and 1 min
+#define NUM_STATS_WINDOWS 2
+
+//Signals for which statistics are computed
+typedef enum {
+  statsPressure,
+  statsFlow,
+  NUM_STATS_SIGNALS
+} statsSignal_t;
+
+static const char *statsSignalNames[NUM_STATS_SIGNALS] = {"PRESS", "FLOW"};
+
+//Number of samples kept per channel for the analysis thread, power of 2
+#define HISTORY_LENGTH 4096
+
+//Maximum number of points returned by a history query
+#define HIST_MAX_POINTS 2000
+
+//Default FFT segment length and analysis interval
+#define DEFAULT_PSD_LENGTH 512
+#define DEFAULT_PSD_INTERVAL 2.0
+
+//System identification record length, and FFT length that holds it
+#define SYSID_MAX_SAMPLES 8192
+#define SYSID_NFFT 16384
+//Number of points of the published frequency response
+#define SYSID_MAX_POINTS 256
+//The step is applied after this fraction of the duration, the part before
+//gives the baseline
+#define SYSID_STEP_FRACTION 0.2
+
+//Pressure range of each Z_regulator_type, used as default regulator limits
+static const double regulatorMin[] = {0, 0, 0, 0, -1000, -1000};
+static const double regulatorMax[] = {0, 200, 2000, 8000, 1000, 6000};
+#define NUM_REGULATOR_TYPES (int)(sizeof(regulatorMax)/sizeof(regulatorMax[0]))
+
+//Regulator types fitted on this OB1, channels 1 to 4
+static const Z_regulator_type defaultRegulatorTypes[MAX_SIGNALS] = {
+  Z_regulator_type__0_2000_mbar, Z_regulator_type__0_2000_mbar,
+  Z_regulator_type__0_8000_mbar, Z_regulator_type__0_8000_mbar};
+
+//Below this pivot the coupling matrix is considered singular
+#define MIMO_MIN_PIVOT 1e-12
+
+//Longest dead time the Smith predictor can compensate, in samples
+#define SMITH_MAX_DELAY 2048
+
+//The learned model is used for feed-forward once it has seen this many
+//settled samples
+#define FF_MIN_SAMPLES 50
+
+//Maximum number of pending time-tagged commands, and of executed commands
+//kept in the log arrays
+#define CMD_QUEUE_SIZE 256
+#define CMD_LOG_SIZE 100
+
+//Maximum length of a sequencer program. This is also the number of steps
+//executed in one cycle at most. A LOOP jump ends the cycle and an endless
+//LOOP must contain a WAIT, WAITFLOW or RAMP, so a loop cannot flood the OB1
+#define SEQ_MAX_STEPS 128
+
+//Slots of the shared memory ring, about 160 s at 100 Hz
+#define SHM_SLOTS 16384
+
+//While ramping down at the end of a dose the pressure never drops below
+//this fraction of the dose pressure, otherwise the flow decays exponentially
+//and the target is never reached
+#define DOSE_RAMP_MIN_FRACTION 0.25
+
+// Dosing state machine, values of EF_DOSE_STATE
+typedef enum {
+  doseIdle,
+  doseRunning,
+  doseRamping,
+  doseDone,
+  doseAborted
+} doseState_t;
+
+// System identification excitation, values of EF_SYSID_MODE
+typedef enum {
+  sysIdStep,
+  sysIdChirp
+} sysIdMode_t;
+
+// System identification state, values of EF_SYSID_STATE
+typedef enum {
+  sysIdIdle,
+  sysIdRunning,
+  sysIdAnalyzing,
+  sysIdDone,
+  sysIdFailed,
+  sysIdAborted
+} sysIdState_t;
+
+// Relay auto-tuning state, values of EF_TUNE_STATE
+typedef enum {
+  tuneIdle,
+  tuneRunning,
+  tuneDone,
+  tuneFailed,
+  tuneAborted
+} tuneState_t;
+
+// Progress of the initialization thread
+typedef enum {
+  initRunning,
+  initDone,
+  initFailed        // OB1_Initialization failed, the port runs without the OB1
+} initState_t;
+
+// Timed phases of the initialization
+typedef enum {
+  initPhaseOpen,            // OB1_Initialization
+  initPhaseCalibration,     // Elveflow_Calibration_Default
+  initPhaseRead,            // first acquisition, seeds the setpoints
+  NUM_INIT_PHASES
+} initPhase_t;
+static const char *initPhaseNames[NUM_INIT_PHASES] = {"open", "calibration", "first read"};
+
+// Calibration state, values of EF_CALIB_STATE
+typedef enum {
+  calibIdle,
+  calibRunning,
+  calibDone,
+  calibFailed,
+  calibCancelled    // finished after a cancel, the result was discarded
+} calibState_t;
+
+// Decoupled control status, values of EF_MIMO_STATUS
+typedef enum {
+  mimoOff,
+  mimoActive,
+  mimoSingular
+} mimoStatus_t;
+
+// What a time-tagged command sets
+typedef enum {
+  cmdPressure,      // EF_SET_PRESSURE, like a write to Pres
+  cmdFlow           // EF_FLOW_SETPOINT
+} cmdKind_t;
+
+// One time-tagged command
+typedef struct {
+  int id;
+  cmdKind_t kind;
+  int channel;
+  double value;
+  epicsTimeStamp due;
+} timedCommand_t;
+
+// Configuration of the sensor of one channel, arguments of OB1_Add_Sens
+typedef struct {
+  int type;                 // Z_sensor_type
+  int kind;                 // Z_Sensor_digit_analog
+  int calib;                // Z_Sensor_FSD_Calib
+  int resolution;           // Z_D_F_S_Resolution
+} sensorConfig_t;
+
+// Achieved rate of an acquisition thread, published about once per second
+typedef struct {
+  int count;                // cycles since start
+  epicsTimeStamp start;
+  int started;
+} laneRate_t;
+
+// Lateness of the cycle starts of an acquisition thread, published about
+// once per second
+typedef struct {
+  EFRunningStats late;      // s after the scheduled start
+  epicsTimeStamp start;
+  int started;
+} cycleJitter_t;
+
+// Start of the acquisitions of all ports aligned to the same tick, shared by
+// the acquisition threads to measure the skew between the controllers
+typedef struct {
+  epicsMutexId lock;
+  double tick;              // tick being collected, s past the EPICS epoch
+  double first;             // earliest and latest acquisition start on it
+  double last;
+  int count;                // ports that reported this tick
+  double skew;              // last - first of the last completed tick, s
+  int ports;                // count of the last completed tick
+} tickSkew_t;
+
+static tickSkew_t tickSkew;
+
+static double timeSeconds(const epicsTimeStamp *t)
+{
+  return t->secPastEpoch + t->nsec * 1e-9;
+}
+
+/** Sets tick to the first multiple of period after now. All ports count
+  * the multiples from the EPICS epoch, so ports with the same period wake
+  * up on the same boundaries. */
+static void nextTick(epicsTimeStamp *tick, const epicsTimeStamp *now, double period)
+{
+  double t = (floor(timeSeconds(now) / period) + 1.0) * period;
+
+  tick->secPastEpoch = (epicsUInt32)t;
+  tick->nsec = (epicsUInt32)((t - tick->secPastEpoch) * 1e9);
+  if (tick->nsec >= 1000000000u) tick->nsec = 999999999u;
+}
+
+/** Records that a port started acquiring at start for the given tick. A
+  * report for a newer tick completes the previous one. Returns the skew and
+  * port count of the last completed tick. */
+static void reportTick(const epicsTimeStamp *tick, const epicsTimeStamp *start,
+                       double *skew, int *ports)
+{
+  double t = timeSeconds(tick), s = timeSeconds(start);
+
+  epicsMutexMustLock(tickSkew.lock);
+  if (t > tickSkew.tick) {
+    if (tickSkew.count > 0) {
+      tickSkew.skew = tickSkew.last - tickSkew.first;
+      tickSkew.ports = tickSkew.count;
+    }
+    tickSkew.tick = t;
+    tickSkew.first = tickSkew.last = s;
+    tickSkew.count = 1;
+  }
+  else if (t == tickSkew.tick) {
+    if (s < tickSkew.first) tickSkew.first = s;
+    if (s > tickSkew.last) tickSkew.last = s;
+    tickSkew.count++;
+  }
+  // A report for an older tick came too late to be counted
+  *skew = tickSkew.skew;
+  *ports = tickSkew.ports;
+  epicsMutexUnlock(tickSkew.lock);
+}
+
+// Sequencer step operations
+typedef enum {
+  seqPres,          // PRES <ch> <mbar>
+  seqRamp,          // RAMP <ch> <mbar> <s>, linear from the current setpoint
+  seqWaitFlow,      // WAITFLOW <ch> <|> <ul/min> [timeout s]
+  seqWait,          // WAIT <s>
+  seqTrig,          // TRIG <0|1>
+  seqLoop           // LOOP <step> <count>, count 0 loops forever
+} seqOp_t;
+
+// One sequencer step
+typedef struct {
+  seqOp_t op;
+  int channel;
+  double value;     // pressure, flow threshold or trigger level
+  double time;      // ramp time, wait time or timeout, s
+  int above;        // WAITFLOW waits for flow > value, otherwise flow < value
+  int target;       // LOOP jumps to this step
+  int count;        // LOOP repetitions
+} seqStep_t;
+
+// Sequencer state, values of EF_SEQ_STATE
+typedef enum {
+  seqIdle,
+  seqRunning,
+  seqDone,
+  seqTimeout,
+  seqAborted,
+  seqFailed
+} seqState_t;
+
+// Per channel acquisition state, owned by the acquisition thread
+typedef struct {
+  double pressure;          // mbar
+  double setpoint;          // last pressure written to the OB1, mbar
+  double digitalFlow;       // latest good value from the digital sensor thread, ul/min
+  int haveDigital;          // digitalFlow holds a good value
+  int digitalHold;          // consecutive suspicious digital samples
+  double rawFlow;           // flow from the OB1, before the user correction, ul/min
+  double flow;              // ul/min
+  double lastFlow;          // previous flow sample, ul/min
+  epicsTimeStamp lastTime;  // timestamp of the previous flow sample
+  int haveLast;             // lastTime/lastFlow hold a valid previous sample
+  double volume;            // integrated volume, ul
+  doseState_t doseState;
+  double doseStartVolume;   // volume when the dose was started, ul
+  int settled;              // settle criterion currently holds
+  int settleArmed;          // waiting for the first settle after a pressure change
+  epicsTimeStamp settleStart; // time of the pressure change
+  epicsTimeStamp statsStart[NUM_STATS_WINDOWS]; // start of the current statistics window
+  int haveStatsStart[NUM_STATS_WINDOWS];
+  int regEnabled;           // PI flow regulator is driving the pressure
+  double regIntegral;       // integral term, mbar
+  double regOutput;         // last pressure applied by the regulator, mbar
+  tuneState_t tuneState;
+  int tuneWasRegulating;    // regulator was enabled when the tuning started
+  double tuneBias;          // pressure the relay switches around, mbar
+  int tuneHigh;             // relay output is bias + amplitude
+  epicsTimeStamp tuneStart;
+  epicsTimeStamp tuneLastSwitch; // last low to high transition
+  int tuneCycles;           // completed relay cycles
+  double tuneCycleMin;      // flow extremes of the current cycle
+  double tuneCycleMax;
+  double tunePeriodSum;     // sums over the measured cycles
+  double tuneAmplSum;
+  int smithActive;          // Smith predictor model is initialized
+  double smithModel;        // undelayed model output, ul/min
+  int smithHead;            // next slot of the model delay line
+  int rampActive;           // setpoint is moving towards rampTarget
+  double rampStart;         // setpoint when the ramp was commanded, mbar
+  double rampTarget;        // mbar
+  double rampVelocity;      // current slope of the setpoint, mbar/s
+} channelState_t;
+
+// Ring buffer of the most recent samples of one channel, written by the
+// acquisition thread and copied out by the analysis thread
+typedef struct {
+  double time[HISTORY_LENGTH];      // seconds past the EPICS epoch
+  double pressure[HISTORY_LENGTH];
+  double flow[HISTORY_LENGTH];
+  int head;                         // next slot to write
+  int count;
+} sampleHistory_t;
+
 /** Class definition for the USBelveFlow class
   */
 class USBelveFlow : public asynPortDriver {
 public:
-  USBelveFlow(const char *portName);
+  USBelveFlow(const char *portName, const char *checkpointFile, int priority, int cpuMask);
   ~USBelveFlow();
   void setAllPressure(int p1=0);
+  void pollerThread();
+  void analysisThread();
+  void digitalThread();
 
   /* These are the methods that we override from asynPortDriver */
   virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
   virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value); 
-  virtual asynStatus readFloat64(asynUser *pasynUser, epicsFloat64 *value);
+  virtual asynStatus readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn);
+  virtual asynStatus writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements);
+  virtual asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t maxChars, size_t *nActual);
   virtual void report(FILE *fp, int details);
+  virtual asynStatus connect(asynUser *pasynUser);
+  void connectSensors();
+  void resumeControl();
+  void initController();
+  void calibThread();
+  int waitInit(double timeout);
+  double initReport(FILE *fp);
+  int joinGroup();
+  void leaveGroup();
+  int groupCycle(const epicsTimeStamp *stamp, double period,
+                 double *pressure, double *flow, double *setpoint);
+  int groupSetPressures(int mask, const double *pressures);
 
 protected:
   int sensorType_;
 
   int setPressure_;
- 
+
   int readPressure_;
   int readSensor_;
 
+  int pollPeriod_;
+
+  int volume_;
+  int volumeReset_;
+  int dosePressure_;
+  int doseTarget_;
+  int doseRamp_;
+  int doseStart_;
+  int doseState_;
+  int doseVolume_;
+
+  int settleTol_;
+  int settleWindow_;
+  int settled_;
+  int settleTime_;
+  int flowMean_;
+  int flowStddev_;
+
+  int statsPeriod_[NUM_STATS_WINDOWS];
+  int statsCount_[NUM_STATS_WINDOWS];
+  int statsMean_[NUM_STATS_WINDOWS][NUM_STATS_SIGNALS];
+  int statsStddev_[NUM_STATS_WINDOWS][NUM_STATS_SIGNALS];
+  int statsMin_[NUM_STATS_WINDOWS][NUM_STATS_SIGNALS];
+  int statsMax_[NUM_STATS_WINDOWS][NUM_STATS_SIGNALS];
+
+  int psdEnable_;
+  int psdLength_;
+  int psdInterval_;
+  int psdRate_;
+  int psdFreq_;
+  int psdPress_;
+  int psdFlow_;
+  int psdPressPeak_;
+  int psdFlowPeak_;
+  int psdPressRms_;
+  int psdFlowRms_;
+
+  int sysIdMode_;
+  int sysIdBase_;
+  int sysIdAmpl_;
+  int sysIdDuration_;
+  int sysIdF0_;
+  int sysIdF1_;
+  int sysIdStart_;
+  int sysIdState_;
+  int sysIdGain_;
+  int sysIdDeadTime_;
+  int sysIdTau_;
+  int sysIdFreq_;
+  int sysIdMag_;
+  int sysIdPhase_;
+  int sysIdTimeData_;
+  int sysIdSetpointData_;
+  int sysIdFlowData_;
+
+  int regEnable_;
+  int flowSetpoint_;
+  int regKp_;
+  int regKi_;
+  int regOutMin_;
+  int regOutMax_;
+
+  int tuneStart_;
+  int tuneState_;
+  int tuneAmpl_;
+  int tuneHyst_;
+  int tuneCycles_;
+  int tuneTimeout_;
+  int tuneKu_;
+  int tunePu_;
+
+  int mimoEnable_;
+  int mimoMatrix_;
+  int mimoStatus_;
+
+  int modelGain_;
+  int modelTau_;
+  int modelDeadTime_;
+  int smithEnable_;
+  int regFeedback_;
+
+  int ffEnable_;
+  int ffForget_;
+  int ffReset_;
+  int ffSlope_;
+  int ffOffset_;
+  int ffSamples_;
+  int ffPressure_;
+
+  int cmdQueue_;
+  int cmdClear_;
+  int cmdPending_;
+  int cmdLastId_;
+  int cmdLastTime_;
+  int cmdLastLateness_;
+  int cmdLogId_;
+  int cmdLogTime_;
+  int cmdLogLateness_;
+
+  int seqProgram_;
+  int seqMessage_;
+  int seqLength_;
+  int seqStart_;
+  int seqState_;
+  int seqStep_;
+  int seqStepTime_;
+  int seqStepTimes_;
+
+  int slewRate_;
+  int slewAccel_;
+  int rampActive_;
+  int rampProgress_;
+  int setpoint_;
+
+  int shmName_;
+  int shmCount_;
+
+  int histSpan_;
+  int histPoints_;
+  int histQuery_;
+  int histTime_;
+  int histMin_[NUM_STATS_SIGNALS];
+  int histMean_[NUM_STATS_SIGNALS];
+  int histMax_[NUM_STATS_SIGNALS];
+
+  int channelMask_;
+  int channelEnabled_;
+
+  int calibStart_;
+  int calibState_;
+  int calibProgress_;
+  int calibElapsed_;
+  int calibDuration_;
+  int calibSave_;
+  int calibFile_;
+  int calibMessage_;
+
+  int sensorKind_;
+  int sensorResolution_;
+  int sensorJump_;
+  int sensorValid_;
+  int sensorResets_;
+  int sensorCalib_;
+  int flowRaw_;
+  int corrMode_;
+  int corrX_;
+  int corrY_;
+  int corrCoefs_;
+  int corrValid_;
+  int digitalPeriod_;
+  int analogRate_;
+  int digitalRate_;
+  int tickAlign_;
+  int tickOffset_;
+  int tickSkew_;
+  int tickPorts_;
+  int cycleJitter_;
+  int cycleLateMax_;
+
 private:
+  int applyPressure(int addr, double value);
+  int acquire();
+  void integrateFlow(int addr, const epicsTimeStamp *now);
+  void processDose(int addr, double period);
+  void startDose(int addr);
+  void stopDose(int addr, doseState_t state);
+  void armSettle(int addr);
+  void processSettle(int addr, const epicsTimeStamp *now, double period);
+  void processStats(int addr, const epicsTimeStamp *now);
+  void recordHistory(int addr, const epicsTimeStamp *now);
+  int copyHistory(int addr, double *time, double *pressure, double *flow);
+  void analyzeChannel(int addr, int nfft);
+  int startSysId(int addr);
+  void stopSysId(sysIdState_t state);
+  void processSysId(int addr, const epicsTimeStamp *now);
+  void analyzeSysId();
+  void abortActiveModes(int addr);
+  void enableRegulator(int addr, int enable);
+  double regulatorOutput(int addr, double period);
+  void processRegulator(int addr, double period);
+  void resetSmith(int addr, double output);
+  double smithCorrection(int addr, double period);
+  void updateSmith(int addr, double output, double period);
+  void learnFlowModel(int addr);
+  void feedForward(int addr);
+  int queueCommands(const char *text);
+  void executeCommands();
+  int loadSequence(const char *text);
+  void startSequence();
+  void stopSequence(seqState_t state);
+  void enterStep(int step, epicsTimeStamp *now);
+  void processSequence(epicsTimeStamp *now);
+  int commandPressure(int addr, double value);
+  void stopRamp(int addr);
+  void processRamp(int addr, double period);
+  void exportSample(epicsTimeStamp *now);
+  void restoreCheckpoint();
+  void saveCheckpoint(const epicsTimeStamp *now);
+  void queryHistory(int addr);
+  int configuredMask();
+  void setChannelMask(int mask);
+  void setCorrection(int addr, int status);
+  int startCalibration();
+  void updateCalibProgress(const epicsTimeStamp *now);
+  int channelEnabled(int addr) { return (_channelMask >> addr) & 1; }
+  int applySensor(int addr, int force);
+  void replaySensors();
+  void updateLaneRate(laneRate_t *lane, const epicsTimeStamp *now, int param);
+  void updateJitter(const epicsTimeStamp *now, double late);
+  void setIoAffinity(const char *thread);
+  int checkDigitalSample(int addr, int status, double value);
+  int applyAllPressure(const double *pressures);
+  int runCycle(const epicsTimeStamp *stamp, double period);
+  int computeDecoupler(const int *active, double *decoupler);
+  void enableMimo(int enable);
+  void processMimo(double period);
+  int startTune(int addr);
+  void stopTune(int addr, tuneState_t state);
+  void processTune(int addr, const epicsTimeStamp *now);
+
   int _MyOB1_ID;
+  Z_regulator_type _regulatorTypes[MAX_SIGNALS];
+  sensorConfig_t _sensorConfig[MAX_SIGNALS];   // requested through the parameters
+  sensorConfig_t _sensorApplied[MAX_SIGNALS];  // what the OB1 was last configured with
+  EFFlowCorrection _correction[MAX_SIGNALS];   // user curve applied to every flow sample
+  int _sensorsReady;          // IOC is running, configuration changes are applied at once
+  laneRate_t _analogRate;
+  laneRate_t _digitalRate;
+  cycleJitter_t _jitter;      // of the acquisition thread
+  int _ioPriority;            // of the acquisition thread and the asyn port thread, 0 for the defaults
+  unsigned long _cpuMask;     // CPUs of the acquisition and digital threads, 0 for any
+  int _digitalError;    // last digital read failed, used to avoid flooding the log
+  int _channelMask;           // bit i set if channel i is acquired
   double *_Calibration; // define the cailbration (array of double). 
                         // Size can vary, depending on the instrument but 1000 is always enough.
                         // will allocate in constructor
+  channelState_t _channels[MAX_SIGNALS];
+  EFSlidingWindow _settleWindow[MAX_SIGNALS];
+  EFRunningStats _stats[MAX_SIGNALS][NUM_STATS_WINDOWS][NUM_STATS_SIGNALS];
+  sampleHistory_t *_history;  // MAX_SIGNALS ring buffers, allocated in constructor
+  EFHistory *_tiers;          // MAX_SIGNALS multi-resolution histories
+  double *_histOut;           // query results, (1 + 3*NUM_STATS_SIGNALS) * HIST_MAX_POINTS
+  // Analysis thread buffers, only used by that thread
+  double *_anaTime;
+  double *_anaPressure;
+  double *_anaFlow;
+  double *_anaPsd;
+  double *_anaFreq;
+  double *_anaWork;
+  // System identification, one channel at a time
+  int _sysIdChannel;          // channel under test, -1 if none
+  sysIdState_t _sysIdState;
+  epicsTimeStamp _sysIdStart;
+  double _sysIdStepTime;      // time the step was applied, s from start
+  double _sysIdSetpoint;      // pressure currently applied by the excitation
+  int _sysIdCount;
+  double *_sysIdTime;
+  double *_sysIdSetpoints;
+  double *_sysIdFlow;         // flow of every channel, SYSID_MAX_SAMPLES per channel
+  double *_sysIdWork;
+  double *_sysIdFreqs;
+  double *_sysIdMags;
+  double *_sysIdPhases;
+  // Decoupled control, _mimoMatrix[i][j] is d flow_i / d pressure_j
+  double _mimoMatrix[MAX_SIGNALS][MAX_SIGNALS];
+  int _mimoEnabled;
+  double _smithDelay[MAX_SIGNALS][SMITH_MAX_DELAY]; // delayed model outputs
+  EFLinearRLS _flowModel[MAX_SIGNALS];  // steady state flow = slope * pressure + offset
+  // Time-tagged commands, sorted by due time
+  timedCommand_t _commands[CMD_QUEUE_SIZE];
+  int _numCommands;
+  int _nextCommandId;
+  double _cmdLogId[CMD_LOG_SIZE];       // executed commands, oldest first
+  double _cmdLogTime[CMD_LOG_SIZE];     // applied time, seconds past the POSIX epoch
+  double _cmdLogLateness[CMD_LOG_SIZE];
+  int _cmdLogCount;
+  // Sequencer program and position
+  seqStep_t _seqSteps[SEQ_MAX_STEPS];
+  int _seqLength;
+  seqState_t _seqState;
+  int _seqStep;
+  epicsTimeStamp _seqStepStart;
+  double _seqRampStart;                 // setpoint when the current RAMP started, mbar
+  int _seqLoopCount[SEQ_MAX_STEPS];     // repetitions done by each LOOP step
+  double _seqStepTimes[SEQ_MAX_STEPS];  // last start of each step, seconds past the POSIX epoch
+  EFShmWriter _shm;                     // live data export for local processes
+  EFCheckpoint _checkpoint;             // control state kept across IOC restarts
+  efCheckpointState_t _restored;        // state read at start, resumed when the IOC is running
+  int _haveRestored;
+  int _checkpointReady;                 // control state is resumed, saved every cycle
+  int _acquireError;    // last acquisition failed, used to avoid flooding the log
+  int _grouped;         // cycles are run by a USBelveFlowGroup, not by the poller
+  // Initialization thread and startup timing, s
+  initState_t _initState;
+  epicsTimeStamp _createTime;           // start of the constructor
+  double _initCreate;                   // constructor, before the thread started
+  double _initPhases[NUM_INIT_PHASES];
+  double _initTotal;                    // constructor start to the end of the initialization
+  double _initWait;                     // time iocInit waited for it
+  epicsEventId _initDoneEvent;
+  // Calibration, OB1_Calib writes into _calibStaging which is then swapped
+  // with _Calibration under the driver lock
+  calibState_t _calibState;
+  int _calibCancel;                     // discard the result when OB1_Calib returns
+  epicsTimeStamp _calibStart;
+  double *_calibStaging;
+  int _digitalReading;                  // digital thread is talking to the OB1 without the driver lock
+  // The Elveflow SDK does not document that calls on one instrument handle
+  // may overlap, so every OB1_* call on _MyOB1_ID holds this lock. It is
+  // taken last, after the driver lock if that is held, and only around the
+  // SDK call itself. OB1_Initialization and OB1_Destructor run while no
+  // other thread uses the handle, OB1_Calib is kept exclusive by the
+  // calibration handshake with the poller and the digital thread.
+  epicsMutexId _ob1Lock;
+  epicsEventId _calibEvent;
+  epicsEventId _calibDoneEvent;
+  int _exiting;
+  epicsEventId _pollerEvent;
+  epicsEventId _pollerDoneEvent;
+  epicsEventId _analysisEvent;
+  epicsEventId _analysisDoneEvent;
+  epicsEventId _digitalEvent;
+  epicsEventId _digitalDoneEvent;
 };
 
 
 
 /** Constructor for the USBelveFlow class
   */
-USBelveFlow::USBelveFlow(const char *portName)
+USBelveFlow::USBelveFlow(const char *portName, const char *checkpointFile, int priority, int cpuMask)
   : asynPortDriver( portName, 
                     MAX_SIGNALS,                             // * maxAddr* /
-      asynInt32Mask | asynFloat64Mask | asynDrvUserMask,    // Interfaces that we implement
-      asynInt32Mask | asynFloat64Mask,                      // Interfaces that do callbacks
+      asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask | asynOctetMask | asynDrvUserMask,    // Interfaces that we implement
+      asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask | asynOctetMask,                      // Interfaces that do callbacks
       ASYN_MULTIDEVICE | ASYN_CANBLOCK,                     //* ASYN_CANBLOCK=1, ASYN_MULTIDEVICE =1 
       1,                                                    // autoConnect=1 */
-      0, 0)  /* Default priority and stack size */
+      priority, 0)  /* Priority of the port thread, 0 for the default, and default stack size */
 {
   static const char *functionName = "USBelveFlow";
-  int status=0;
 
+  epicsTimeGetCurrent(&_createTime);
   _MyOB1_ID = -1;  // initialized myOB1ID at negative value (after initialization it should become positive or =0)
                   // initialize the OB1 -> Use NiMAX to determine the device name
                   //avoid non alphanumeric characters in device name
-  _Calibration = new double[1000]; // Size can vary, depending on the instrument but 1000 is always enough
+  _Calibration = new double[CALIB_LEN]; // Size can vary, depending on the instrument but 1000 is always enough
+  _calibStaging = new double[CALIB_LEN];
+  memset(_channels, 0, sizeof(_channels));
+  _history = new sampleHistory_t[MAX_SIGNALS];
+  memset(_history, 0, MAX_SIGNALS * sizeof(sampleHistory_t));
+  _tiers = new EFHistory[MAX_SIGNALS];
+  _histOut = new double[(1 + 3*NUM_STATS_SIGNALS) * HIST_MAX_POINTS];
+  _anaTime = new double[HISTORY_LENGTH];
+  _anaPressure = new double[HISTORY_LENGTH];
+  _anaFlow = new double[HISTORY_LENGTH];
+  _anaPsd = new double[HISTORY_LENGTH/2 + 1];
+  _anaFreq = new double[HISTORY_LENGTH/2 + 1];
+  _anaWork = new double[2 * HISTORY_LENGTH];
+  _sysIdChannel = -1;
+  _sysIdState = sysIdIdle;
+  _sysIdCount = 0;
+  _sysIdTime = new double[SYSID_MAX_SAMPLES];
+  _sysIdSetpoints = new double[SYSID_MAX_SAMPLES];
+  _sysIdFlow = new double[MAX_SIGNALS * SYSID_MAX_SAMPLES];
+  _sysIdWork = new double[4 * SYSID_NFFT];
+  _sysIdFreqs = new double[SYSID_MAX_POINTS];
+  _sysIdMags = new double[SYSID_MAX_POINTS];
+  _sysIdPhases = new double[SYSID_MAX_POINTS];
+  // Until the coupling is entered or identified the channels are independent
+  memset(_mimoMatrix, 0, sizeof(_mimoMatrix));
+  for (int i = 0; i < MAX_SIGNALS; i++) _mimoMatrix[i][i] = 1.0;
+  _mimoEnabled = 0;
+  _numCommands = 0;
+  _nextCommandId = 1;
+  _cmdLogCount = 0;
+  _seqLength = 0;
+  _seqState = seqIdle;
+  _seqStep = 0;
+  _acquireError = 0;
+  _grouped = 0;
+  _haveRestored = 0;
+  _checkpointReady = 0;
+  _initState = initRunning;
+  memset(_initPhases, 0, sizeof(_initPhases));
+  _initTotal = 0.0;
+  _initWait = 0.0;
+  _calibState = calibIdle;
+  _calibCancel = 0;
+  _digitalReading = 0;
+  _exiting = 0;
+  _ioPriority = priority;
+  _cpuMask = (unsigned long)(unsigned int)cpuMask;
+  _jitter.started = 0;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    _regulatorTypes[i] = defaultRegulatorTypes[i];
+    _sensorConfig[i].type = Z_sensor_type_none;
+    _sensorConfig[i].kind = Z_Sensor_digit_analog_Analog;
+    _sensorConfig[i].calib = Z_Sensor_FSD_Calib_H2O;
+    _sensorConfig[i].resolution = Z_D_F_S_Resolution__16Bit;
+    _sensorApplied[i] = _sensorConfig[i];
+  }
+  _sensorsReady = 0;
+  memset(&_analogRate, 0, sizeof(_analogRate));
+  memset(&_digitalRate, 0, sizeof(_digitalRate));
+  _digitalError = 0;
+  _channelMask = configuredMask();
+
+  // Sensor type param
+  createParam(EFSensorTypeString, asynParamInt32, &sensorType_);
+  createParam(EFSensorKindString,       asynParamInt32,   &sensorKind_);
+  createParam(EFSensorResolutionString, asynParamInt32,   &sensorResolution_);
+  createParam(EFSensorJumpString,       asynParamFloat64, &sensorJump_);
+  createParam(EFSensorValidString,      asynParamInt32,   &sensorValid_);
+  createParam(EFSensorResetsString,     asynParamInt32,   &sensorResets_);
+  createParam(EFSensorCalibString,      asynParamInt32,   &sensorCalib_);
+  createParam(EFFlowRawString,          asynParamFloat64, &flowRaw_);
+  createParam(EFCorrModeString,         asynParamInt32,   &corrMode_);
+  createParam(EFCorrXString,            asynParamFloat64Array, &corrX_);
+  createParam(EFCorrYString,            asynParamFloat64Array, &corrY_);
+  createParam(EFCorrCoefsString,        asynParamFloat64Array, &corrCoefs_);
+  createParam(EFCorrValidString,        asynParamInt32,   &corrValid_);
+  createParam(EFDigitalPeriodString,    asynParamFloat64, &digitalPeriod_);
+  createParam(EFAnalogRateString,       asynParamFloat64, &analogRate_);
+  createParam(EFDigitalRateString,      asynParamFloat64, &digitalRate_);
+  createParam(EFTickAlignString,        asynParamInt32,   &tickAlign_);
+  createParam(EFTickOffsetString,       asynParamFloat64, &tickOffset_);
+  createParam(EFTickSkewString,         asynParamFloat64, &tickSkew_);
+  createParam(EFTickPortsString,        asynParamInt32,   &tickPorts_);
+  createParam(EFCycleJitterString,      asynParamFloat64, &cycleJitter_);
+  createParam(EFCycleLateMaxString,     asynParamFloat64, &cycleLateMax_);
+
+  // Channel enable parameters
+  createParam(EFChannelMaskString,     asynParamInt32, &channelMask_);
+  createParam(EFChannelEnabledString,  asynParamInt32, &channelEnabled_);
+
+  // Calibration parameters
+  createParam(EFCalibStartString,      asynParamInt32,   &calibStart_);
+  createParam(EFCalibStateString,      asynParamInt32,   &calibState_);
+  createParam(EFCalibProgressString,   asynParamFloat64, &calibProgress_);
+  createParam(EFCalibElapsedString,    asynParamFloat64, &calibElapsed_);
+  createParam(EFCalibDurationString,   asynParamFloat64, &calibDuration_);
+  createParam(EFCalibSaveString,       asynParamInt32,   &calibSave_);
+  createParam(EFCalibFileString,       asynParamOctet,   &calibFile_);
+  createParam(EFCalibMessageString,    asynParamOctet,   &calibMessage_);
+
+  // Analog output parameters
+  createParam(EFSetPressureString,    asynParamFloat64, &setPressure_);
+
+  // Analog Input parameters
+  createParam(EFReadFlowSting,        asynParamFloat64, &readSensor_);
+  createParam(EFReadPressureString,   asynParamFloat64, &readPressure_);
+
+  // Acquisition parameters
+  createParam(EFPollPeriodString,     asynParamFloat64, &pollPeriod_);
+
+  // Volume totalizer and dosing parameters
+  createParam(EFVolumeString,         asynParamFloat64, &volume_);
+  createParam(EFVolumeResetString,    asynParamInt32,   &volumeReset_);
+  createParam(EFDosePressureString,   asynParamFloat64, &dosePressure_);
+  createParam(EFDoseTargetString,     asynParamFloat64, &doseTarget_);
+  createParam(EFDoseRampString,       asynParamFloat64, &doseRamp_);
+  createParam(EFDoseStartString,      asynParamInt32,   &doseStart_);
+  createParam(EFDoseStateString,      asynParamInt32,   &doseState_);
+  createParam(EFDoseVolumeString,     asynParamFloat64, &doseVolume_);
+
+  // Flow settled detector parameters
+  createParam(EFSettleTolString,      asynParamFloat64, &settleTol_);
+  createParam(EFSettleWindowString,   asynParamFloat64, &settleWindow_);
+  createParam(EFSettledString,        asynParamInt32,   &settled_);
+  createParam(EFSettleTimeString,     asynParamFloat64, &settleTime_);
+  createParam(EFFlowMeanString,       asynParamFloat64, &flowMean_);
+  createParam(EFFlowStddevString,     asynParamFloat64, &flowStddev_);
+
+  // Running statistics parameters
+  for (int w = 0; w < NUM_STATS_WINDOWS; w++) {
+    char name[64];
+    epicsSnprintf(name, sizeof(name), EFStatsPeriodString, w+1);
+    createParam(name, asynParamFloat64, &statsPeriod_[w]);
+    epicsSnprintf(name, sizeof(name), EFStatsCountString, w+1);
+    createParam(name, asynParamInt32, &statsCount_[w]);
+    for (int j = 0; j < NUM_STATS_SIGNALS; j++) {
+      epicsSnprintf(name, sizeof(name), EFStatsMeanString, w+1, statsSignalNames[j]);
+      createParam(name, asynParamFloat64, &statsMean_[w][j]);
+      epicsSnprintf(name, sizeof(name), EFStatsStddevString, w+1, statsSignalNames[j]);
+      createParam(name, asynParamFloat64, &statsStddev_[w][j]);
+      epicsSnprintf(name, sizeof(name), EFStatsMinString, w+1, statsSignalNames[j]);
+      createParam(name, asynParamFloat64, &statsMin_[w][j]);
+      epicsSnprintf(name, sizeof(name), EFStatsMaxString, w+1, statsSignalNames[j]);
+      createParam(name, asynParamFloat64, &statsMax_[w][j]);
+    }
+  }
+
+  // Spectral analysis parameters
+  createParam(EFPsdEnableString,      asynParamInt32,        &psdEnable_);
+  createParam(EFPsdLengthString,      asynParamInt32,        &psdLength_);
+  createParam(EFPsdIntervalString,    asynParamFloat64,      &psdInterval_);
+  createParam(EFPsdRateString,        asynParamFloat64,      &psdRate_);
+  createParam(EFPsdFreqString,        asynParamFloat64Array, &psdFreq_);
+  createParam(EFPsdPressString,       asynParamFloat64Array, &psdPress_);
+  createParam(EFPsdFlowString,        asynParamFloat64Array, &psdFlow_);
+  createParam(EFPsdPressPeakString,   asynParamFloat64,      &psdPressPeak_);
+  createParam(EFPsdFlowPeakString,    asynParamFloat64,      &psdFlowPeak_);
+  createParam(EFPsdPressRmsString,    asynParamFloat64,      &psdPressRms_);
+  createParam(EFPsdFlowRmsString,     asynParamFloat64,      &psdFlowRms_);
+
+  // System identification parameters
+  createParam(EFSysIdModeString,         asynParamInt32,        &sysIdMode_);
+  createParam(EFSysIdBaseString,         asynParamFloat64,      &sysIdBase_);
+  createParam(EFSysIdAmplString,         asynParamFloat64,      &sysIdAmpl_);
+  createParam(EFSysIdDurationString,     asynParamFloat64,      &sysIdDuration_);
+  createParam(EFSysIdF0String,           asynParamFloat64,      &sysIdF0_);
+  createParam(EFSysIdF1String,           asynParamFloat64,      &sysIdF1_);
+  createParam(EFSysIdStartString,        asynParamInt32,        &sysIdStart_);
+  createParam(EFSysIdStateString,        asynParamInt32,        &sysIdState_);
+  createParam(EFSysIdGainString,         asynParamFloat64,      &sysIdGain_);
+  createParam(EFSysIdDeadTimeString,     asynParamFloat64,      &sysIdDeadTime_);
+  createParam(EFSysIdTauString,          asynParamFloat64,      &sysIdTau_);
+  createParam(EFSysIdFreqString,         asynParamFloat64Array, &sysIdFreq_);
+  createParam(EFSysIdMagString,          asynParamFloat64Array, &sysIdMag_);
+  createParam(EFSysIdPhaseString,        asynParamFloat64Array, &sysIdPhase_);
+  createParam(EFSysIdTimeDataString,     asynParamFloat64Array, &sysIdTimeData_);
+  createParam(EFSysIdSetpointDataString, asynParamFloat64Array, &sysIdSetpointData_);
+  createParam(EFSysIdFlowDataString,     asynParamFloat64Array, &sysIdFlowData_);
+
+  // Flow regulator parameters
+  createParam(EFRegEnableString,      asynParamInt32,   &regEnable_);
+  createParam(EFFlowSetpointString,   asynParamFloat64, &flowSetpoint_);
+  createParam(EFRegKpString,          asynParamFloat64, &regKp_);
+  createParam(EFRegKiString,          asynParamFloat64, &regKi_);
+  createParam(EFRegOutMinString,      asynParamFloat64, &regOutMin_);
+  createParam(EFRegOutMaxString,      asynParamFloat64, &regOutMax_);
+
+  // Relay auto-tuning parameters
+  createParam(EFTuneStartString,      asynParamInt32,   &tuneStart_);
+  createParam(EFTuneStateString,      asynParamInt32,   &tuneState_);
+  createParam(EFTuneAmplString,       asynParamFloat64, &tuneAmpl_);
+  createParam(EFTuneHystString,       asynParamFloat64, &tuneHyst_);
+  createParam(EFTuneCyclesString,     asynParamInt32,   &tuneCycles_);
+  createParam(EFTuneTimeoutString,    asynParamFloat64, &tuneTimeout_);
+  createParam(EFTuneKuString,         asynParamFloat64, &tuneKu_);
+  createParam(EFTunePuString,         asynParamFloat64, &tunePu_);
+
+  // Decoupled multi-channel control parameters
+  createParam(EFMimoEnableString,     asynParamInt32,        &mimoEnable_);
+  createParam(EFMimoMatrixString,     asynParamFloat64Array, &mimoMatrix_);
+  createParam(EFMimoStatusString,     asynParamInt32,        &mimoStatus_);
+
+  // Process model and Smith predictor parameters
+  createParam(EFModelGainString,      asynParamFloat64, &modelGain_);
+  createParam(EFModelTauString,       asynParamFloat64, &modelTau_);
+  createParam(EFModelDeadTimeString,  asynParamFloat64, &modelDeadTime_);
+  createParam(EFSmithEnableString,    asynParamInt32,   &smithEnable_);
+  createParam(EFRegFeedbackString,    asynParamFloat64, &regFeedback_);
+
+  // Feed-forward parameters
+  createParam(EFFfEnableString,       asynParamInt32,   &ffEnable_);
+  createParam(EFFfForgetString,       asynParamFloat64, &ffForget_);
+  createParam(EFFfResetString,        asynParamInt32,   &ffReset_);
+  createParam(EFFfSlopeString,        asynParamFloat64, &ffSlope_);
+  createParam(EFFfOffsetString,       asynParamFloat64, &ffOffset_);
+  createParam(EFFfSamplesString,      asynParamInt32,   &ffSamples_);
+  createParam(EFFfPressureString,     asynParamFloat64, &ffPressure_);
+
+  // Time-tagged command queue parameters
+  createParam(EFCmdQueueString,        asynParamOctet,        &cmdQueue_);
+  createParam(EFCmdClearString,        asynParamInt32,        &cmdClear_);
+  createParam(EFCmdPendingString,      asynParamInt32,        &cmdPending_);
+  createParam(EFCmdLastIdString,       asynParamInt32,        &cmdLastId_);
+  createParam(EFCmdLastTimeString,     asynParamFloat64,      &cmdLastTime_);
+  createParam(EFCmdLastLatenessString, asynParamFloat64,      &cmdLastLateness_);
+  createParam(EFCmdLogIdString,        asynParamFloat64Array, &cmdLogId_);
+  createParam(EFCmdLogTimeString,      asynParamFloat64Array, &cmdLogTime_);
+  createParam(EFCmdLogLatenessString,  asynParamFloat64Array, &cmdLogLateness_);
+
+  // Sequencer parameters
+  createParam(EFSeqProgramString,      asynParamOctet,        &seqProgram_);
+  createParam(EFSeqMessageString,      asynParamOctet,        &seqMessage_);
+  createParam(EFSeqLengthString,       asynParamInt32,        &seqLength_);
+  createParam(EFSeqStartString,        asynParamInt32,        &seqStart_);
+  createParam(EFSeqStateString,        asynParamInt32,        &seqState_);
+  createParam(EFSeqStepString,         asynParamInt32,        &seqStep_);
+  createParam(EFSeqStepTimeString,     asynParamFloat64,      &seqStepTime_);
+  createParam(EFSeqStepTimesString,    asynParamFloat64Array, &seqStepTimes_);
+
+  // Setpoint ramp parameters
+  createParam(EFSlewRateString,        asynParamFloat64, &slewRate_);
+  createParam(EFSlewAccelString,       asynParamFloat64, &slewAccel_);
+  createParam(EFRampActiveString,      asynParamInt32,   &rampActive_);
+  createParam(EFRampProgressString,    asynParamFloat64, &rampProgress_);
+  createParam(EFSetpointString,        asynParamFloat64, &setpoint_);
 
-  status = OB1_Initialization("01C8453E", Z_regulator_type__0_2000_mbar, Z_regulator_type__0_2000_mbar, Z_regulator_type__0_8000_mbar, Z_regulator_type__0_8000_mbar, &_MyOB1_ID);
+  // Shared memory export parameters
+  createParam(EFShmNameString,         asynParamOctet,   &shmName_);
+  createParam(EFShmCountString,        asynParamInt32,   &shmCount_);
+
+  // History query parameters
+  createParam(EFHistSpanString,        asynParamFloat64,      &histSpan_);
+  createParam(EFHistPointsString,      asynParamInt32,        &histPoints_);
+  createParam(EFHistQueryString,       asynParamInt32,        &histQuery_);
+  createParam(EFHistTimeString,        asynParamFloat64Array, &histTime_);
+  for (int j = 0; j < NUM_STATS_SIGNALS; j++) {
+    char name[64];
+    epicsSnprintf(name, sizeof(name), EFHistMinString, statsSignalNames[j]);
+    createParam(name, asynParamFloat64Array, &histMin_[j]);
+    epicsSnprintf(name, sizeof(name), EFHistMeanString, statsSignalNames[j]);
+    createParam(name, asynParamFloat64Array, &histMean_[j]);
+    epicsSnprintf(name, sizeof(name), EFHistMaxString, statsSignalNames[j]);
+    createParam(name, asynParamFloat64Array, &histMax_[j]);
+  }
+
+  setDoubleParam(pollPeriod_, DEFAULT_POLL_PERIOD);
+  setIntegerParam(psdLength_, DEFAULT_PSD_LENGTH);
+  setDoubleParam(psdInterval_, DEFAULT_PSD_INTERVAL);
+  setIntegerParam(mimoEnable_, 0);
+  setIntegerParam(mimoStatus_, mimoOff);
+  setIntegerParam(cmdPending_, 0);
+  setIntegerParam(channelMask_, _channelMask);
+  setDoubleParam(digitalPeriod_, DEFAULT_DIGITAL_PERIOD);
+  setDoubleParam(analogRate_, 0.0);
+  setDoubleParam(digitalRate_, 0.0);
+  setIntegerParam(tickAlign_, 1);
+  setDoubleParam(tickOffset_, 0.0);
+  setDoubleParam(tickSkew_, 0.0);
+  setIntegerParam(tickPorts_, 0);
+  setDoubleParam(cycleJitter_, 0.0);
+  setDoubleParam(cycleLateMax_, 0.0);
+  setIntegerParam(seqLength_, 0);
+  setIntegerParam(seqState_, seqIdle);
+  setStringParam(seqMessage_, "");
+  setIntegerParam(calibStart_, 0);
+  setIntegerParam(calibState_, calibIdle);
+  setDoubleParam(calibProgress_, 0.0);
+  setDoubleParam(calibElapsed_, 0.0);
+  setDoubleParam(calibDuration_, DEFAULT_CALIB_DURATION);
+  setIntegerParam(calibSave_, 0);
+  setStringParam(calibFile_, "");
+  setStringParam(calibMessage_, "");
+
+  // The export is optional, the driver works without it
+  char shmName[64];
+  efShmName(shmName, sizeof(shmName), portName);
+  if (_shm.open(portName, SHM_SLOTS, DEFAULT_POLL_PERIOD)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s:%s, port %s, cannot create shared memory %s\n",
+              driverName, functionName, portName, shmName);
+    shmName[0] = '\0';
+  }
+  setStringParam(shmName_, shmName);
+  setIntegerParam(shmCount_, 0);
+
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    setDoubleParam(i, volume_, 0.0);
+    setDoubleParam(i, doseVolume_, 0.0);
+    setIntegerParam(i, doseState_, doseIdle);
+    setDoubleParam(i, settleTol_, 0.0);
+    setDoubleParam(i, settleWindow_, 1.0);
+    setIntegerParam(i, settled_, 0);
+    setDoubleParam(i, settleTime_, 0.0);
+    for (int w = 0; w < NUM_STATS_WINDOWS; w++)
+      setDoubleParam(i, statsPeriod_[w], (w == 0) ? 1.0 : 60.0);
+    setIntegerParam(i, psdEnable_, 0);
+    setIntegerParam(i, sysIdState_, sysIdIdle);
+    setDoubleParam(i, sysIdDuration_, 10.0);
+    setDoubleParam(i, sysIdF0_, 0.1);
+    setDoubleParam(i, sysIdF1_, 5.0);
+    int type = _regulatorTypes[i];
+    if (type < 0 || type >= NUM_REGULATOR_TYPES) type = Z_regulator_type_none;
+    setIntegerParam(i, regEnable_, 0);
+    setDoubleParam(i, regOutMin_, regulatorMin[type]);
+    setDoubleParam(i, regOutMax_, regulatorMax[type]);
+    setIntegerParam(i, tuneState_, tuneIdle);
+    setIntegerParam(i, tuneCycles_, 4);
+    setDoubleParam(i, tuneTimeout_, 120.0);
+    setIntegerParam(i, smithEnable_, 0);
+    setIntegerParam(i, ffEnable_, 0);
+    setDoubleParam(i, ffForget_, 0.999);
+    setIntegerParam(i, ffSamples_, 0);
+    setDoubleParam(i, slewRate_, 0.0);
+    setDoubleParam(i, slewAccel_, 0.0);
+    setIntegerParam(i, rampActive_, 0);
+    setDoubleParam(i, rampProgress_, 100.0);
+    setDoubleParam(i, setpoint_, 0.0);
+    setDoubleParam(i, histSpan_, 600.0);
+    setIntegerParam(i, channelEnabled_, channelEnabled(i));
+    setIntegerParam(i, sensorType_, Z_sensor_type_none);
+    setIntegerParam(i, sensorKind_, Z_Sensor_digit_analog_Analog);
+    setIntegerParam(i, sensorResolution_, Z_D_F_S_Resolution__16Bit);
+    setDoubleParam(i, sensorJump_, 0.0);
+    setIntegerParam(i, sensorValid_, 1);
+    setIntegerParam(i, sensorResets_, 0);
+    setIntegerParam(i, sensorCalib_, Z_Sensor_FSD_Calib_H2O);
+    setIntegerParam(i, corrMode_, EFFlowCorrection::OFF);
+    setIntegerParam(i, corrValid_, 1);
+    setIntegerParam(i, histPoints_, 600);
+    callParamCallbacks(i);
+  }
+
+  // The checkpoint is optional, without it the control state starts empty
+  if (checkpointFile && checkpointFile[0]) {
+    if (_checkpoint.open(checkpointFile, portName))
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s, port %s, cannot open checkpoint file %s\n",
+                driverName, functionName, portName, checkpointFile);
+    else if (_checkpoint.restore(&_restored) == 0)
+      restoreCheckpoint();
+  }
+
+  _pollerEvent = epicsEventMustCreate(epicsEventEmpty);
+  _pollerDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+  _analysisEvent = epicsEventMustCreate(epicsEventEmpty);
+  _analysisDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+  _digitalEvent = epicsEventMustCreate(epicsEventEmpty);
+  _digitalDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+  _ob1Lock = epicsMutexMustCreate();
+  _initDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+  _calibEvent = epicsEventMustCreate(epicsEventEmpty);
+  _calibDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+
+  // Set exit handler to clean up
+  epicsAtExit(exitCallbackC, this);
+
+  // Spectral analysis runs at low priority so it never delays acquisition
+  epicsThreadCreate("USBelveFlowAnalysis",
+                    epicsThreadPriorityLow,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)analysisThreadC,
+                    this);
+
+  // OB1_Calib takes minutes, it runs on its own thread when requested
+  epicsThreadCreate("USBelveFlowCalib",
+                    epicsThreadPriorityLow,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)calibThreadC,
+                    this);
+
+  // Opening the OB1 takes seconds, it is done on its own thread so that
+  // the controllers of an IOC start in parallel. The port stays
+  // disconnected until it is done.
+  pasynManager->exceptionDisconnect(pasynUserSelf);
+  epicsTimeStamp now;
+  epicsTimeGetCurrent(&now);
+  _initCreate = epicsTimeDiffInSeconds(&now, &_createTime);
+  epicsThreadCreate("USBelveFlowInit",
+                    epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)initThreadC,
+                    this);
+}
+
+ USBelveFlow::~USBelveFlow()
+ {
+  // Only called once the initialization thread is done, see exitCallbackC
+  lock();
+  _exiting = 1;
+  unlock();
+  epicsEventSignal(_pollerEvent);
+  epicsEventSignal(_analysisEvent);
+  epicsEventSignal(_digitalEvent);
+  epicsEventSignal(_calibEvent);
+  epicsEventWaitWithTimeout(_pollerDoneEvent, 1.0);
+  epicsEventWaitWithTimeout(_analysisDoneEvent, 1.0);
+  epicsEventWaitWithTimeout(_digitalDoneEvent, 1.0);
+  epicsEventWaitWithTimeout(_calibDoneEvent, 1.0);
+  // With a checkpoint the next IOC resumes from the pressures the OB1 holds
+  if (_checkpoint.isOpen()) _checkpoint.close();
+  else setAllPressure();
+  OB1_Destructor(_MyOB1_ID);
+  epicsMutexDestroy(_ob1Lock);
+  _shm.close();
+  delete[] _Calibration;
+  delete[] _calibStaging;
+  delete[] _history;
+  delete[] _tiers;
+  delete[] _histOut;
+  delete[] _anaTime;
+  delete[] _anaPressure;
+  delete[] _anaFlow;
+  delete[] _anaPsd;
+  delete[] _anaFreq;
+  delete[] _anaWork;
+  delete[] _sysIdTime;
+  delete[] _sysIdSetpoints;
+  delete[] _sysIdFlow;
+  delete[] _sysIdWork;
+  delete[] _sysIdFreqs;
+  delete[] _sysIdMags;
+  delete[] _sysIdPhases;
+ }
+
+/** Initialization thread: opens the OB1, loads the calibration and seeds
+  * the setpoints, then starts the acquisition threads and connects the
+  * port. Several controllers initialize in parallel, iocInit waits for
+  * all of them in elveFlowInitHook. */
+void USBelveFlow::initController(){
+  static const char *functionName = "initController";
+  epicsTimeStamp start, end;
+  int status;
+
+  epicsTimeGetCurrent(&start);
+  status = OB1_Initialization("01C8453E", _regulatorTypes[0], _regulatorTypes[1], _regulatorTypes[2], _regulatorTypes[3], &_MyOB1_ID);
   // ID is found via NIMAX software. Should be configurable from epics record 
   if (status ==- 1)
     asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s device not found\n", driverName, functionName);
@@ -105,41 +1470,109 @@ USBelveFlow::USBelveFlow(const char *portName)
   else 
     asynPrint(pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s device found\n", driverName, functionName);
  */
+  epicsTimeGetCurrent(&end);
+  _initPhases[initPhaseOpen] = epicsTimeDiffInSeconds(&end, &start);
 
-  if(status==0){
-     status = Elveflow_Calibration_Default(_Calibration, 1000); //use default _calibration
+  epicsTimeGetCurrent(&start);
+  if (status == 0) {
+     status = Elveflow_Calibration_Default(_Calibration, CALIB_LEN); //use default _calibration
   }
-  else
+  else 
     asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s No calibration loaded\n", driverName, functionName);
-  // Sensor type param
-  createParam(EFSensorTypeString, asynParamInt32, &sensorType_);
+  epicsTimeGetCurrent(&end);
+  _initPhases[initPhaseCalibration] = epicsTimeDiffInSeconds(&end, &start);
 
-  // Analog output parameters
-  createParam(EFSetPressureString,    asynParamFloat64, &setPressure_);
+  lock();
+  start = end;
+  // Bumpless reboot: the setpoints start from the pressures the OB1 is
+  // holding, read for all channels in one acquisition
+  if (acquire())
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s::%s port %s, cannot read the pressures, setpoints not seeded\n",
+              driverName, functionName, this->portName);
+  else {
+    for (int i = 0; i < MAX_SIGNALS; i++) {
+      if (_regulatorTypes[i] == Z_regulator_type_none) continue;
+      setDoubleParam(i, readPressure_, _channels[i].pressure);
+      setDoubleParam(i, setPressure_, _channels[i].pressure);
+      setDoubleParam(i, setpoint_, _channels[i].pressure);
+      _channels[i].setpoint = _channels[i].pressure;
+    }
+  }
+  for (int i = 0; i < MAX_SIGNALS; i++) callParamCallbacks(i);
+  epicsTimeGetCurrent(&end);
+  _initPhases[initPhaseRead] = epicsTimeDiffInSeconds(&end, &start);
 
-  // Analog Input parameters
-  createParam(EFReadFlowSting,        asynParamFloat64, &readSensor_);
-  createParam(EFReadPressureString,   asynParamFloat64, &readPressure_);
+  _initState = (_MyOB1_ID < 0) ? initFailed : initDone;
+  _initTotal = epicsTimeDiffInSeconds(&end, &_createTime);
+  // The IOC may already be running if iocInit stopped waiting
+  if (_sensorsReady) replaySensors();
+  unlock();
 
-  //read pressure for bumpless reboot
-  double fVal;
-  int channel =1;
+  // The acquisition thread reads all channels every poll period,
+  // integrates the flow and runs the dosing state machine
+  epicsThreadCreate("USBelveFlowPoller",
+                    _ioPriority ? _ioPriority : epicsThreadPriorityHigh,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)pollerThreadC,
+                    this);
 
-  status = OB1_Get_Press(_MyOB1_ID, channel, 1, _Calibration, &fVal, 1000);
-  //do smth with status: log, report
+  // Digital sensors are read on their own thread, so their slower protocol
+  // delays the pressure acquisition by one read at most. With a configured
+  // priority it runs one step below the acquisition thread, or at the same
+  // priority if that is already the lowest one that can be configured.
+  epicsThreadCreate("USBelveFlowDigital",
+                    !_ioPriority ? epicsThreadPriorityMedium :
+                    (_ioPriority - 1 > (int)epicsThreadPriorityMin ? _ioPriority - 1 : _ioPriority),
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)digitalThreadC,
+                    this);
 
-  setDoubleParam(readPressure_, fVal);
-  setDoubleParam(setPressure_, fVal);
-  // Set exit handler to clean up
-  epicsAtExit(exitCallbackC, this);
+  pasynManager->exceptionConnect(pasynUserSelf);
+  epicsEventSignal(_initDoneEvent);
 }
 
- USBelveFlow::~USBelveFlow()
- {
-  setAllPressure();
-  OB1_Destructor(_MyOB1_ID);
-  delete[] _Calibration;
- }
+/** Waits at most timeout seconds for the initialization thread.
+  * Returns 0 if it has finished. */
+int USBelveFlow::waitInit(double timeout){
+  epicsTimeStamp start, end;
+  int status;
+
+  epicsTimeGetCurrent(&start);
+  status = epicsEventWaitWithTimeout(_initDoneEvent, timeout);
+  // Left signalled for the next waiter
+  if (status == epicsEventWaitOK) epicsEventSignal(_initDoneEvent);
+  epicsTimeGetCurrent(&end);
+  _initWait = epicsTimeDiffInSeconds(&end, &start);
+  return (status == epicsEventWaitOK) ? 0 : -1;
+}
+
+/** The port is only connected once the initialization thread has opened
+  * the OB1, so that records do not talk to it before. */
+asynStatus USBelveFlow::connect(asynUser *pasynUser){
+  int running;
+
+  lock();
+  running = (_initState == initRunning);
+  unlock();
+  if (running) return asynError;
+  return asynPortDriver::connect(pasynUser);
+}
+
+/** One line of USBelveFlowInitReport, times in seconds. Returns the time
+  * the initialization would take if it was not run in parallel. */
+double USBelveFlow::initReport(FILE *fp){
+  static const char *stateNames[] = {"running", "done", "failed"};
+  double serial = _initCreate;
+
+  fprintf(fp, "%-16s %-8s %8.3f", this->portName, stateNames[_initState], _initCreate);
+  for (int i = 0; i < NUM_INIT_PHASES; i++) {
+    fprintf(fp, " %11.3f", _initPhases[i]);
+    serial += _initPhases[i];
+  }
+  fprintf(fp, " %8.3f %8.3f\n", _initTotal, _initWait);
+  return serial;
+}
 
 asynStatus USBelveFlow::writeInt32(asynUser *pasynUser, epicsInt32 value){
   int addr;
@@ -150,19 +1583,102 @@ asynStatus USBelveFlow::writeInt32(asynUser *pasynUser, epicsInt32 value){
   this->getAddress(pasynUser, &addr);
   setIntegerParam(addr, function, value);
 
-  if (function == sensorType_) {
-    cout<<"addr= "<<addr<<endl;
-    status = OB1_Add_Sens(_MyOB1_ID, addr+1, value, Z_Sensor_digit_analog_Analog, Z_Sensor_FSD_Calib_H2O, Z_D_F_S_Resolution__16Bit); 
-    if (status ==- 1){
-      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s device not found\n", driverName, functionName);
+  if (function == sensorType_ || function == sensorKind_ ||
+      function == sensorResolution_ || function == sensorCalib_) {
+    sensorConfig_t *pc = &_sensorConfig[addr];
+    if (function == sensorType_) pc->type = value;
+    else if (function == sensorKind_) pc->kind = value;
+    else if (function == sensorCalib_) pc->calib = value;
+    else pc->resolution = value;
+    // During iocInit the configuration is only cached, connectSensors()
+    // applies all of it in one pass once the IOC is running. A calibration
+    // applies it when it ends.
+    if (_sensorsReady && _calibState != calibRunning) status = applySensor(addr, 0);
+  }
+  else if (function == corrMode_) {
+    setCorrection(addr, _correction[addr].setMode(value));
+  }
+  else if (function == channelMask_) {
+    setChannelMask(value);
+    epicsEventSignal(_digitalEvent);
+  }
+  else if (function == histQuery_) {
+    queryHistory(addr);
+  }
+  else if (function == volumeReset_) {
+    _channels[addr].volume = 0.0;
+    _channels[addr].doseStartVolume = 0.0;
+    setDoubleParam(addr, volume_, 0.0);
+    setDoubleParam(addr, doseVolume_, 0.0);
+  }
+  else if (function == doseStart_) {
+    if (value) {
+      abortActiveModes(addr);
+      startDose(addr);
     }
-
-    else {
-      asynPrint(pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s device found\n", driverName, functionName);
+    else stopDose(addr, doseAborted);
+  }
+  else if (function == sysIdStart_) {
+    if (value) {
+      status = startSysId(addr);
+      if (status) setIntegerParam(addr, sysIdStart_, 0);
+    }
+    else if (addr == _sysIdChannel && _sysIdState == sysIdRunning) stopSysId(sysIdAborted);
+  }
+  else if (function == regEnable_) {
+    if (value) abortActiveModes(addr);
+    enableRegulator(addr, value);
+  }
+  else if (function == mimoEnable_) {
+    enableMimo(value);
+  }
+  else if (function == cmdClear_) {
+    _numCommands = 0;
+    setIntegerParam(cmdPending_, 0);
+  }
+  else if (function == seqStart_) {
+    if (value) startSequence();
+    else if (_seqState == seqRunning) stopSequence(seqAborted);
+  }
+  else if (function == calibStart_) {
+    if (value) status = startCalibration();
+    else if (_calibState == calibRunning) {
+      _calibCancel = 1;
+      setStringParam(calibMessage_, "Cancelled, the result will be discarded when OB1_Calib returns");
+    }
+    setIntegerParam(calibStart_, _calibState == calibRunning && !_calibCancel);
+  }
+  else if (function == ffReset_) {
+    _flowModel[addr].reset();
+    setIntegerParam(addr, ffSamples_, 0);
+  }
+  else if (function == smithEnable_) {
+    // The model restarts from the current output on the next cycle
+    _channels[addr].smithActive = 0;
+  }
+  else if (function == tuneStart_) {
+    if (value) {
+      status = startTune(addr);
+      if (status) setIntegerParam(addr, tuneStart_, 0);
     }
+    else if (_channels[addr].tuneState == tuneRunning) stopTune(addr, tuneAborted);
+  }
+  else if (function == psdLength_) {
+    // FFT segment length must be a power of 2 that fits in the history
+    int nfft = 16;
+    while (nfft * 2 <= value && nfft * 2 <= HISTORY_LENGTH) nfft *= 2;
+    setIntegerParam(psdLength_, nfft);
   }
   callParamCallbacks(addr);
-  //If more params are added, consider adding asynPrint(pasynUser, ASYN_TRACEIO_DRIVER, ....
+  if (status == 0) {
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER, 
+             "%s:%s, port %s, wrote %d to address %d\n",
+             driverName, functionName, this->portName, value, addr);
+  } else {
+    asynPrint(pasynUser, ASYN_TRACE_ERROR, 
+             "%s:%s, port %s, ERROR writing %d to address %d, status=%d\n",
+             driverName, functionName, this->portName, value, addr, status);
+  }
   return (status == 0) ? asynSuccess : asynError;
 
 }
@@ -179,54 +1695,181 @@ asynStatus USBelveFlow::writeFloat64(asynUser *pasynUser, epicsFloat64 value){
 
   // Analog output functions
   if (function == setPressure_) {
-    status = OB1_Set_Press(_MyOB1_ID, addr+1, value, _Calibration, 1000);
-    // Numbers needs to be chaged to constants    
+    status = commandPressure(addr, value);
+  }
+  else if (function == flowSetpoint_) {
+    feedForward(addr);
+  }
+  else if (function == modelGain_ || function == modelTau_ || function == modelDeadTime_) {
+    _channels[addr].smithActive = 0;
+  }
+  else if (function == settleWindow_) {
+    // The window length in samples is recomputed on the next cycle
+    _settleWindow[addr].setLength(1);
+  }
+  else if (function == pollPeriod_) {
+    _shm.setPeriod(value);
+    // Wake up the poller so that the new period is used immediately
+    epicsEventSignal(_pollerEvent);
   }
 
   callParamCallbacks(addr);
   if (status == 0) {
     asynPrint(pasynUser, ASYN_TRACEIO_DRIVER, 
-             "%s:%s, port %s, wrote %d to address %d\n",
+             "%s:%s, port %s, wrote %f to address %d\n",
              driverName, functionName, this->portName, value, addr);
   } else {
     asynPrint(pasynUser, ASYN_TRACE_ERROR, 
-             "%s:%s, port %s, ERROR writing %d to address %d, status=%d\n",
+             "%s:%s, port %s, ERROR writing %f to address %d, status=%d\n",
              driverName, functionName, this->portName, value, addr, status);
   }
 
   return (status == 0) ? asynSuccess : asynError;
 }
 
-
-asynStatus USBelveFlow::readFloat64(asynUser *pasynUser, epicsFloat64 *value){
-  int addr;
+asynStatus USBelveFlow::writeOctet(asynUser *pasynUser, const char *value, size_t maxChars, size_t *nActual){
   int function = pasynUser->reason;
   int status=0;
-  double fVal = -1;
-  int filter=0;
-  static const char *functionName = "readFloat64";
-
-  this->getAddress(pasynUser, &addr);
+  static const char *functionName = "writeOctet";
+  char text[4096];
+  size_t n = (maxChars < sizeof(text)) ? maxChars : sizeof(text) - 1;
+  const char *paramName = "";
 
-  if (function == readPressure_) { 
-    status = OB1_Get_Press(_MyOB1_ID, addr+1, 1, _Calibration, &fVal, 1000);
-    *value = fVal;
-    setDoubleParam(addr, readPressure_, *value);
+  memcpy(text, value, n);
+  text[n] = '\0';
+  if (function == cmdQueue_) {
+    paramName = EFCmdQueueString;
+    // A text that does not fit is rejected rather than parsed truncated
+    status = (maxChars >= sizeof(text)) ? -1 : queueCommands(text);
+    setStringParam(cmdQueue_, text);
+    // Wake up the poller so that it waits for the earliest deadline
+    epicsEventSignal(_pollerEvent);
   }
-
-  else if(function == readSensor_){
-    status = OB1_Get_Sens_Data(_MyOB1_ID, addr+1, 1, &fVal);  
-    *value = fVal;
-    setDoubleParam(addr, readSensor_, *value);
+  else if (function == seqProgram_) {
+    paramName = EFSeqProgramString;
+    if (maxChars >= sizeof(text)) {
+      setStringParam(seqMessage_, "Program too long");
+      status = -1;
+    }
+    else status = loadSequence(text);
+    if (status == 0) setStringParam(seqProgram_, text);
   }
-  // Other functions we call the base class method
   else {
-     status = asynPortDriver::readFloat64(pasynUser, value);
+    return asynPortDriver::writeOctet(pasynUser, value, maxChars, nActual);
+  }
+  *nActual = maxChars;
+  callParamCallbacks();
+  if (status) {
+    asynPrint(pasynUser, ASYN_TRACE_ERROR,
+              "%s:%s, port %s, ERROR parsing %s '%s', nothing was applied\n",
+              driverName, functionName, this->portName, paramName, text);
   }
-  callParamCallbacks(addr);
-  //If more params are added, consider adding asynPrint(pasynUser, ASYN_TRACEIO_DRIVER, ....
   return (status == 0) ? asynSuccess : asynError;
+}
+
+asynStatus USBelveFlow::readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn){
+  int function = pasynUser->reason;
+
+  if (function == mimoMatrix_) {
+    size_t n = MAX_SIGNALS * MAX_SIGNALS;
+    if (nElements < n) n = nElements;
+    memcpy(value, _mimoMatrix, n * sizeof(double));
+    *nIn = n;
+    return asynSuccess;
+  }
+  if (function == corrX_ || function == corrY_ || function == corrCoefs_) {
+    const EFFlowCorrection *pc;
+    const double *data;
+    size_t n;
+    int addr;
+
+    getAddress(pasynUser, &addr);
+    pc = &_correction[addr];
+    if (function == corrX_) { data = pc->x(); n = pc->numX(); }
+    else if (function == corrY_) { data = pc->y(); n = pc->numY(); }
+    else { data = pc->coefs(); n = pc->numCoefs(); }
+    if (nElements < n) n = nElements;
+    memcpy(value, data, n * sizeof(double));
+    *nIn = n;
+    return asynSuccess;
+  }
+  return asynPortDriver::readFloat64Array(pasynUser, value, nElements, nIn);
+}
+
+asynStatus USBelveFlow::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements){
+  int function = pasynUser->reason;
+  static const char *functionName = "writeFloat64Array";
+
+  if (function == mimoMatrix_) {
+    // Row major, element [i*4+j] is the flow change of channel i per mbar on channel j
+    if (nElements != MAX_SIGNALS * MAX_SIGNALS) {
+      asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s, port %s, coupling matrix needs %d elements, got %d\n",
+                driverName, functionName, this->portName, MAX_SIGNALS * MAX_SIGNALS, (int)nElements);
+      return asynError;
+    }
+    memcpy(_mimoMatrix, value, nElements * sizeof(double));
+    doCallbacksFloat64Array(&_mimoMatrix[0][0], nElements, mimoMatrix_, 0);
+    return asynSuccess;
+  }
+  if (function == corrX_ || function == corrY_ || function == corrCoefs_) {
+    int max = (function == corrCoefs_) ? EFFlowCorrection::MAX_COEFS : EFFlowCorrection::MAX_POINTS;
+    EFFlowCorrection *pc;
+    int addr;
+
+    getAddress(pasynUser, &addr);
+    if ((int)nElements > max) {
+      asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s, port %s, channel %d, correction curve takes at most %d elements, got %d\n",
+                driverName, functionName, this->portName, addr+1, max, (int)nElements);
+      return asynError;
+    }
+    pc = &_correction[addr];
+    // X and Y of a table are written one after the other, the curve is
+    // passed through until both have the same length
+    if (function == corrX_) setCorrection(addr, pc->setX(value, (int)nElements));
+    else if (function == corrY_) setCorrection(addr, pc->setY(value, (int)nElements));
+    else setCorrection(addr, pc->setCoefs(value, (int)nElements));
+    doCallbacksFloat64Array(value, nElements, function, addr);
+    callParamCallbacks(addr);
+    return asynSuccess;
+  }
+  return asynPortDriver::writeFloat64Array(pasynUser, value, nElements);
+}
+
+/** Sets the pressure of one channel and publishes it in EF_SETPOINT.
+  * EF_SET_PRESSURE follows too, except during a slew limited ramp where it
+  * holds the ramp target. Must be called with the driver locked. */
+int USBelveFlow::applyPressure(int addr, double value){
+  int status;
+
+  if (_calibState == calibRunning) return -1;
+  _channels[addr].setpoint = value;
+  setDoubleParam(addr, setpoint_, value);
+  if (!_channels[addr].rampActive) setDoubleParam(addr, setPressure_, value);
+  epicsMutexMustLock(_ob1Lock);
+  status = OB1_Set_Press(_MyOB1_ID, addr+1, value, _Calibration, CALIB_LEN);
+  epicsMutexUnlock(_ob1Lock);
+  return status;
+}
 
+/** Sets the pressure of all channels with a single OB1_Set_All_Press and
+  * publishes them like applyPressure. Must be called with the driver locked. */
+int USBelveFlow::applyAllPressure(const double *pressures){
+  double set_all_pressure [MAX_SIGNALS];
+  int status;
+
+  if (_calibState == calibRunning) return -1;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    set_all_pressure[i] = pressures[i];
+    _channels[i].setpoint = pressures[i];
+    setDoubleParam(i, setpoint_, pressures[i]);
+    if (!_channels[i].rampActive) setDoubleParam(i, setPressure_, pressures[i]);
+  }
+  epicsMutexMustLock(_ob1Lock);
+  status = OB1_Set_All_Press(_MyOB1_ID, set_all_pressure, _Calibration, MAX_SIGNALS, CALIB_LEN);
+  epicsMutexUnlock(_ob1Lock);
+  return status;
 }
 
 void USBelveFlow::setAllPressure(int p1){
@@ -237,44 +1880,2478 @@ void USBelveFlow::setAllPressure(int p1){
       {
         set_all_pressure[i] = p1;// create the array with all data
       }
-      OB1_Set_All_Press(_MyOB1_ID, set_all_pressure, _Calibration, 4, 1000);
-}
-
-/* Report parameters */ 
-void USBelveFlow::report(FILE *fp, int details){
-  fprintf(fp, " Port: %s \n", this->portName); 
-  asynPortDriver::report(fp, details); 
+      epicsMutexMustLock(_ob1Lock);
+      OB1_Set_All_Press(_MyOB1_ID, set_all_pressure, _Calibration, 4, CALIB_LEN);
+      epicsMutexUnlock(_ob1Lock);
 }
 
-//_____________________________________________________________________________________________
+/** Reads pressure and flow of all channels in one acquisition.
+  * Only the first call asks the OB1 to acquire, the others convert the data
+  * already in memory. Must be called with the driver locked. */
+int USBelveFlow::acquire(){
+  static const char *functionName = "acquire";
+  int status=0;
+  double fVal;
 
-/** Callback function that is called by EPICS when the IOC exits */
+  int acquired = 0;
+
+  // The first read of a cycle acquires the data of all channels, the
+  // others return it. Nothing is read for disabled channels or for a
+  // regulator or sensor that is not fitted. The SDK lock is held for the
+  // whole cycle, so that no other call comes between the acquiring read
+  // and the ones returning its data.
+  epicsMutexMustLock(_ob1Lock);
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    if (!channelEnabled(i)) continue;
+    if (_regulatorTypes[i] != Z_regulator_type_none) {
+      status |= OB1_Get_Press(_MyOB1_ID, i+1, !acquired, _Calibration, &fVal, CALIB_LEN);
+      _channels[i].pressure = fVal;
+      acquired = 1;
+    }
+    if (_sensorApplied[i].type != Z_sensor_type_none) {
+      if (_sensorApplied[i].kind == Z_Sensor_digit_analog_Digital) {
+        // Read by the digital sensor thread, the latest value is held
+        _channels[i].rawFlow = _channels[i].digitalFlow;
+      }
+      else {
+        status |= OB1_Get_Sens_Data(_MyOB1_ID, i+1, !acquired, &fVal);
+        _channels[i].rawFlow = fVal;
+        acquired = 1;
+      }
+      _channels[i].flow = _correction[i].apply(_channels[i].rawFlow);
+    }
+  }
+  epicsMutexUnlock(_ob1Lock);
+  if (status && !_acquireError)
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s::%s port %s, acquisition failed, status=%d\n",
+              driverName, functionName, this->portName, status);
+  _acquireError = (status != 0);
+  return status;
+}
+
+/** Trapezoidal integration of the flow (ul/min) between the previous and the
+  * current sample, using the acquisition timestamps. */
+void USBelveFlow::integrateFlow(int addr, const epicsTimeStamp *now){
+  channelState_t *pch = &_channels[addr];
+
+  if (pch->haveLast) {
+    double dt = epicsTimeDiffInSeconds(now, &pch->lastTime);
+    if (dt > 0)
+      pch->volume += 0.5 * (pch->lastFlow + pch->flow) * dt / 60.0;
+  }
+  pch->lastFlow = pch->flow;
+  pch->lastTime = *now;
+  pch->haveLast = 1;
+}
+
+void USBelveFlow::startDose(int addr){
+  double pressure, target;
+
+  getDoubleParam(addr, dosePressure_, &pressure);
+  getDoubleParam(addr, doseTarget_, &target);
+  if (target <= 0) {
+    setIntegerParam(addr, doseState_, doseDone);
+    return;
+  }
+  _channels[addr].doseStartVolume = _channels[addr].volume;
+  _channels[addr].doseState = doseRunning;
+  setDoubleParam(addr, doseVolume_, 0.0);
+  setIntegerParam(addr, doseState_, doseRunning);
+  applyPressure(addr, pressure);
+}
+
+void USBelveFlow::stopDose(int addr, doseState_t state){
+  doseState_t current = _channels[addr].doseState;
+
+  if (current == doseRunning || current == doseRamping)
+    applyPressure(addr, 0.0);
+  _channels[addr].doseState = state;
+  setIntegerParam(addr, doseState_, state);
+  setIntegerParam(addr, doseStart_, 0);
+}
+
+/** End-of-dose detection, runs every acquisition cycle. The dose is stopped
+  * as soon as the volume expected before the next sample would reach the
+  * target, so the overshoot is at most a fraction of one cycle of flow. */
+void USBelveFlow::processDose(int addr, double period){
+  channelState_t *pch = &_channels[addr];
+  double target, ramp, pressure, dispensed, remaining, fraction;
+
+  if (pch->doseState != doseRunning && pch->doseState != doseRamping) return;
+
+  getDoubleParam(addr, doseTarget_, &target);
+  getDoubleParam(addr, doseRamp_, &ramp);
+  getDoubleParam(addr, dosePressure_, &pressure);
+
+  dispensed = pch->volume - pch->doseStartVolume;
+  remaining = target - dispensed;
+  setDoubleParam(addr, doseVolume_, dispensed);
+
+  if (remaining <= 0.5 * fabs(pch->flow) * period / 60.0) {
+    stopDose(addr, doseDone);
+    return;
+  }
+  if (ramp > 0 && remaining < ramp) {
+    fraction = remaining / ramp;
+    if (fraction < DOSE_RAMP_MIN_FRACTION) fraction = DOSE_RAMP_MIN_FRACTION;
+    if (pch->doseState != doseRamping) {
+      pch->doseState = doseRamping;
+      setIntegerParam(addr, doseState_, doseRamping);
+    }
+    applyPressure(addr, pressure * fraction);
+  }
+}
+
+/** Restarts the settle timer, called when the pressure setpoint changes */
+void USBelveFlow::armSettle(int addr){
+  channelState_t *pch = &_channels[addr];
+
+  epicsTimeGetCurrent(&pch->settleStart);
+  pch->settleArmed = 1;
+  pch->settled = 0;
+  setIntegerParam(addr, settled_, 0);
+}
+
+/** Flow settled detector, runs every acquisition cycle. The flow is settled
+  * when the window is full, its standard deviation is within the tolerance
+  * and the latest sample does not deviate from the window mean by more than
+  * the tolerance. The first time this holds after a pressure change the
+  * elapsed time is published as the time-to-settle. */
+void USBelveFlow::processSettle(int addr, const epicsTimeStamp *now, double period){
+  channelState_t *pch = &_channels[addr];
+  EFSlidingWindow *pwin = &_settleWindow[addr];
+  double tol, window;
+  int length, settled;
+
+  getDoubleParam(addr, settleTol_, &tol);
+  getDoubleParam(addr, settleWindow_, &window);
+  length = (int)(window / period + 0.5);
+  if (length < 2) length = 2;
+  if (length > EFSlidingWindow::MAX_LENGTH) length = EFSlidingWindow::MAX_LENGTH;
+  if (length != pwin->length()) pwin->setLength(length);
+
+  pwin->add(pch->flow);
+  setDoubleParam(addr, flowMean_, pwin->mean());
+  setDoubleParam(addr, flowStddev_, pwin->stddev());
+
+  settled = (tol > 0) && pwin->full() && (pwin->stddev() <= tol) &&
+            (fabs(pch->flow - pwin->mean()) <= tol);
+  if (settled != pch->settled) {
+    pch->settled = settled;
+    setIntegerParam(addr, settled_, settled);
+  }
+  if (settled && pch->settleArmed) {
+    pch->settleArmed = 0;
+    setDoubleParam(addr, settleTime_, epicsTimeDiffInSeconds(now, &pch->settleStart));
+  }
+}
+
+/** Running statistics over consecutive windows of statsPeriod seconds.
+  * Every acquired sample is accumulated, the results are published once
+  * per window so the records update at the window rate. */
+void USBelveFlow::processStats(int addr, const epicsTimeStamp *now){
+  channelState_t *pch = &_channels[addr];
+  double values[NUM_STATS_SIGNALS];
+  double period;
+
+  values[statsPressure] = pch->pressure;
+  values[statsFlow] = pch->flow;
+
+  for (int w = 0; w < NUM_STATS_WINDOWS; w++) {
+    EFRunningStats *pstats = _stats[addr][w];
+
+    getDoubleParam(addr, statsPeriod_[w], &period);
+    if (period <= 0) continue;
+    if (!pch->haveStatsStart[w]) {
+      pch->statsStart[w] = *now;
+      pch->haveStatsStart[w] = 1;
+    }
+    for (int j = 0; j < NUM_STATS_SIGNALS; j++)
+      pstats[j].add(values[j]);
+
+    if (epicsTimeDiffInSeconds(now, &pch->statsStart[w]) < period) continue;
+
+    setIntegerParam(addr, statsCount_[w], pstats[0].count());
+    for (int j = 0; j < NUM_STATS_SIGNALS; j++) {
+      setDoubleParam(addr, statsMean_[w][j], pstats[j].mean());
+      setDoubleParam(addr, statsStddev_[w][j], pstats[j].stddev());
+      setDoubleParam(addr, statsMin_[w][j], pstats[j].minimum());
+      setDoubleParam(addr, statsMax_[w][j], pstats[j].maximum());
+      pstats[j].clear();
+    }
+    // Windows are back to back, restart from now after a long overrun
+    epicsTimeAddSeconds(&pch->statsStart[w], period);
+    if (epicsTimeDiffInSeconds(now, &pch->statsStart[w]) >= period)
+      pch->statsStart[w] = *now;
+  }
+}
+
+/** Appends the current sample to the channel history ring */
+void USBelveFlow::recordHistory(int addr, const epicsTimeStamp *now){
+  sampleHistory_t *ph = &_history[addr];
+
+  ph->time[ph->head] = now->secPastEpoch + now->nsec * 1.e-9;
+  ph->pressure[ph->head] = _channels[addr].pressure;
+  ph->flow[ph->head] = _channels[addr].flow;
+  ph->head = (ph->head + 1) % HISTORY_LENGTH;
+  if (ph->count < HISTORY_LENGTH) ph->count++;
+
+  double values[EF_HIST_SIGNALS] = {_channels[addr].pressure, _channels[addr].flow};
+  _tiers[addr].add(now->secPastEpoch + now->nsec * 1.e-9, values);
+}
+
+/** Configures the sensor of a channel with OB1_Add_Sens, unless the OB1
+  * already has this configuration. force sends it in any case, after a
+  * reconnection. The resolution, 9 to 16 bit, only applies to digital
+  * sensors: fewer bits give a faster reading. Must be called with the
+  * driver locked. */
+int USBelveFlow::applySensor(int addr, int force){
+  static const char *functionName = "applySensor";
+  sensorConfig_t *pc = &_sensorConfig[addr];
+  int status, previous;
+
+  if (!force && memcmp(pc, &_sensorApplied[addr], sizeof(*pc)) == 0) return 0;
+  if (force && pc->type == Z_sensor_type_none && _sensorApplied[addr].type == Z_sensor_type_none) return 0;
+
+  epicsMutexMustLock(_ob1Lock);
+  status = OB1_Add_Sens(_MyOB1_ID, addr+1, pc->type, pc->kind, pc->calib, pc->resolution);
+  epicsMutexUnlock(_ob1Lock);
+  if (status) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s::%s port %s, channel %d, OB1_Add_Sens failed, status=%d\n",
+              driverName, functionName, this->portName, addr+1, status);
+    return status;
+  }
+
+  // The channel follows the new configuration, other bits are kept
+  previous = (configuredMask() >> addr) & 1;
+  _sensorApplied[addr] = *pc;
+  if (((configuredMask() >> addr) & 1) != previous)
+    setChannelMask((_channelMask & ~(1 << addr)) | (configuredMask() & (1 << addr)));
+  _channels[addr].haveDigital = 0;
+  _channels[addr].digitalHold = 0;
+  epicsEventSignal(_digitalEvent);
+  return 0;
+}
+
+/** Sends the configuration of every fitted sensor to the OB1 in one pass.
+  * Must be called with the driver locked. */
+void USBelveFlow::replaySensors(){
+  for (int i = 0; i < MAX_SIGNALS; i++) applySensor(i, 1);
+  for (int i = 0; i < MAX_SIGNALS; i++) callParamCallbacks(i);
+}
+
+/** Called once the IOC is running: applies the configuration cached from
+  * the PINI writes and applies later changes at once. */
+void USBelveFlow::connectSensors(){
+  lock();
+  _sensorsReady = 1;
+  // Otherwise initController() applies it when it has opened the OB1
+  if (_initState != initRunning) replaySensors();
+  unlock();
+}
+
+/** Counts one cycle of an acquisition thread and publishes its rate once
+  * per second. Must be called with the driver locked. */
+void USBelveFlow::updateLaneRate(laneRate_t *lane, const epicsTimeStamp *now, int param){
+  double elapsed;
+
+  if (!lane->started) {
+    lane->start = *now;
+    lane->count = 0;
+    lane->started = 1;
+    return;
+  }
+  lane->count++;
+  elapsed = epicsTimeDiffInSeconds(now, &lane->start);
+  if (elapsed >= 1.0) {
+    setDoubleParam(param, lane->count / elapsed);
+    lane->start = *now;
+    lane->count = 0;
+  }
+}
+
+/** Collects how late the acquisition cycles start and publishes the
+  * standard deviation and the maximum about once per second. Must be
+  * called with the driver locked. */
+void USBelveFlow::updateJitter(const epicsTimeStamp *now, double late){
+  if (!_jitter.started) {
+    _jitter.start = *now;
+    _jitter.late.clear();
+    _jitter.started = 1;
+  }
+  _jitter.late.add(late);
+  if (epicsTimeDiffInSeconds(now, &_jitter.start) >= 1.0) {
+    setDoubleParam(cycleJitter_, _jitter.late.stddev());
+    setDoubleParam(cycleLateMax_, _jitter.late.maximum());
+    _jitter.start = *now;
+    _jitter.late.clear();
+  }
+}
+
+/** Moves the calling I/O thread to the CPUs given to USBelveFlowConfig */
+void USBelveFlow::setIoAffinity(const char *thread){
+  if (efSetThreadAffinity(_cpuMask))
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s::setIoAffinity port %s, cannot set the CPU mask 0x%lx of the %s thread\n",
+              driverName, this->portName, _cpuMask, thread);
+}
+
+/** Checks a digital sensor sample for the signature of a sensor reset: a
+  * read error, an exact zero after a non zero value, or a jump larger than
+  * EF_SENSOR_JUMP. Such samples are not used, the last good value is held
+  * and the flow readback is set to INVALID. Returns 1 if the sensor must be
+  * added again. Must be called with the driver locked. */
+int USBelveFlow::checkDigitalSample(int addr, int status, double value){
+  channelState_t *pch = &_channels[addr];
+  double jump;
+  int suspicious, resets;
+
+  getDoubleParam(addr, sensorJump_, &jump);
+  suspicious = (status != 0) ||
+               (pch->haveDigital && value == 0.0 && pch->digitalFlow != 0.0) ||
+               (pch->haveDigital && jump > 0 && fabs(value - pch->digitalFlow) >= jump);
+
+  // A value that persists is real, e.g. the flow was stopped
+  if (!suspicious || (status == 0 && pch->digitalHold >= SENSOR_MAX_HOLD - 1)) {
+    pch->digitalFlow = value;
+    pch->haveDigital = 1;
+    pch->digitalHold = 0;
+    setIntegerParam(addr, sensorValid_, 1);
+    return 0;
+  }
+
+  pch->digitalHold++;
+  setIntegerParam(addr, sensorValid_, 0);
+  if (pch->digitalHold % SENSOR_RETRY_CYCLES != 1) return 0;
+  getIntegerParam(addr, sensorResets_, &resets);
+  setIntegerParam(addr, sensorResets_, resets + 1);
+  return 1;
+}
+
+/** Digital sensor thread: reads the digital flow sensors of the enabled
+  * channels every EF_DIGITAL_PERIOD, or as fast as they answer. The reads
+  * are done without the driver lock, only under the SDK lock, and the
+  * acquisition thread picks up the latest values. */
+void USBelveFlow::digitalThread(){
+  static const char *functionName = "digitalThread";
+  epicsTimeStamp start, now;
+  int channels[MAX_SIGNALS], n;
+  double values[MAX_SIGNALS], period, delay;
+  int status[MAX_SIGNALS], failed;
+  sensorConfig_t config[MAX_SIGNALS];
+  int reAdd[MAX_SIGNALS];
+
+  setIoAffinity("digital");
+  lock();
+  while (!_exiting) {
+    getDoubleParam(digitalPeriod_, &period);
+    n = 0;
+    for (int i = 0; i < MAX_SIGNALS && _calibState != calibRunning; i++)
+      if (channelEnabled(i) && _sensorApplied[i].type != Z_sensor_type_none &&
+          _sensorApplied[i].kind == Z_Sensor_digit_analog_Digital) {
+        // Configuration used if the sensor has to be added again
+        config[n] = _sensorApplied[i];
+        channels[n++] = i;
+      }
+    _digitalReading = (n > 0);
+    unlock();
+
+    // The SDK lock is taken per read, the acquisition thread waits for one
+    // digital read at most
+    epicsTimeGetCurrent(&start);
+    for (int k = 0; k < n; k++) {
+      epicsMutexMustLock(_ob1Lock);
+      status[k] = OB1_Get_Sens_Data(_MyOB1_ID, channels[k]+1, 0, &values[k]);
+      epicsMutexUnlock(_ob1Lock);
+    }
+    epicsTimeGetCurrent(&now);
+
+    lock();
+    failed = 0;
+    for (int k = 0; k < n; k++) {
+      reAdd[k] = checkDigitalSample(channels[k], status[k], values[k]);
+      if (status[k]) failed = status[k];
+    }
+    unlock();
+
+    // The sensor is added again right away, before its next read. The SDK
+    // lock keeps the acquisition thread out of the OB1 meanwhile.
+    for (int k = 0; k < n; k++) {
+      if (!reAdd[k]) continue;
+      epicsMutexMustLock(_ob1Lock);
+      OB1_Add_Sens(_MyOB1_ID, channels[k]+1, config[k].type, config[k].kind,
+                   config[k].calib, config[k].resolution);
+      epicsMutexUnlock(_ob1Lock);
+    }
+
+    lock();
+    _digitalReading = 0;
+    if (failed && !_digitalError)
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s port %s, digital sensor read failed, status=%d\n",
+                driverName, functionName, this->portName, failed);
+    _digitalError = (failed != 0);
+    if (n > 0) updateLaneRate(&_digitalRate, &now, digitalRate_);
+    else {
+      _digitalRate.started = 0;
+      setDoubleParam(digitalRate_, 0.0);
+    }
+    unlock();
+
+    // Without digital sensors wait for a configuration change
+    delay = (n > 0) ? period - epicsTimeDiffInSeconds(&now, &start) : 1.0;
+    if (delay > 0) epicsEventWaitWithTimeout(_digitalEvent, delay);
+    lock();
+  }
+  unlock();
+  epicsEventSignal(_digitalDoneEvent);
+}
+
+/** Starts a calibration. Every mode driving the pressures is stopped, the
+  * acquisition pauses until OB1_Calib returns. All channels must be closed
+  * with caps. Must be called with the driver locked. */
+int USBelveFlow::startCalibration(){
+  static const char *functionName = "startCalibration";
+
+  if (_calibState == calibRunning || _initState != initDone) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s:%s, port %s, cannot calibrate, %s\n", driverName, functionName, this->portName,
+              (_calibState == calibRunning) ? "already calibrating" : "OB1 not initialized");
+    return -1;
+  }
+  if (_seqState == seqRunning) stopSequence(seqAborted);
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    abortActiveModes(i);
+    _channels[i].haveLast = 0;
+    callParamCallbacks(i);
+  }
+  _calibState = calibRunning;
+  _calibCancel = 0;
+  epicsTimeGetCurrent(&_calibStart);
+  setIntegerParam(calibState_, calibRunning);
+  setDoubleParam(calibProgress_, 0.0);
+  setDoubleParam(calibElapsed_, 0.0);
+  setStringParam(calibMessage_, "Calibrating, all channels must be closed");
+  epicsEventSignal(_calibEvent);
+  return 0;
+}
+
+/** Progress of the running calibration. OB1_Calib does not report any,
+  * it is estimated from the duration of the last calibration and held
+  * below 100 % until it returns. Must be called with the driver locked. */
+void USBelveFlow::updateCalibProgress(const epicsTimeStamp *now){
+  double elapsed = epicsTimeDiffInSeconds(now, &_calibStart);
+  double expected, progress;
+
+  getDoubleParam(calibDuration_, &expected);
+  progress = (expected > 0) ? 100.0 * elapsed / expected : 0.0;
+  if (progress > 99.0) progress = 99.0;
+  setDoubleParam(calibElapsed_, elapsed);
+  setDoubleParam(calibProgress_, progress);
+}
+
+/** Calibration thread: runs OB1_Calib into the staging buffer without the
+  * driver lock, then swaps it with the live calibration and optionally
+  * saves it. */
+void USBelveFlow::calibThread(){
+  epicsTimeStamp now;
+  double *staging, elapsed;
+  char path[256], message[320];
+  int id, status, save;
+  calibState_t state;
+
+  lock();
+  while (!_exiting) {
+    unlock();
+    epicsEventWait(_calibEvent);
+    lock();
+    if (_exiting || _calibState != calibRunning) continue;
+
+    // The acquisition has stopped, wait for the digital thread to let go
+    while (_digitalReading && !_exiting) {
+      unlock();
+      epicsThreadSleep(0.01);
+      lock();
+    }
+    id = _MyOB1_ID;
+    staging = _calibStaging;
+    unlock();
+    status = OB1_Calib(id, staging, CALIB_LEN);
+    epicsTimeGetCurrent(&now);
+    lock();
+
+    elapsed = epicsTimeDiffInSeconds(&now, &_calibStart);
+    setDoubleParam(calibElapsed_, elapsed);
+    if (_calibCancel) {
+      state = calibCancelled;
+      epicsSnprintf(message, sizeof(message), "Cancelled after %.0f s, calibration unchanged", elapsed);
+    }
+    else if (status) {
+      state = calibFailed;
+      epicsSnprintf(message, sizeof(message), "OB1_Calib failed, status=%d, calibration unchanged", status);
+    }
+    else {
+      // The acquisition uses the new calibration from its next cycle
+      _calibStaging = _Calibration;
+      _Calibration = staging;
+      state = calibDone;
+      setDoubleParam(calibDuration_, elapsed);
+      epicsSnprintf(message, sizeof(message), "Calibrated in %.0f s", elapsed);
+
+      // The SDK asks for a file with a dialog if the path is not valid,
+      // nothing is saved without a path
+      getIntegerParam(calibSave_, &save);
+      getStringParam(calibFile_, sizeof(path), path);
+      if (save && path[0]) {
+        unlock();
+        status = Elveflow_Calibration_Save(path, staging, CALIB_LEN);
+        lock();
+        epicsSnprintf(message, sizeof(message), status ? "Calibrated in %.0f s, saving to %s failed" :
+                      "Calibrated in %.0f s, saved to %s", elapsed, path);
+      }
+    }
+    _calibState = state;
+    setIntegerParam(calibState_, state);
+    setIntegerParam(calibStart_, 0);
+    if (state == calibDone) setDoubleParam(calibProgress_, 100.0);
+    setStringParam(calibMessage_, message);
+    // The sensors are configured again before the acquisition resumes
+    if (_sensorsReady) replaySensors();
+    callParamCallbacks();
+    epicsEventSignal(_digitalEvent);
+  }
+  unlock();
+  epicsEventSignal(_calibDoneEvent);
+}
+
+/** Channels that have a pressure regulator or a sensor fitted */
+int USBelveFlow::configuredMask(){
+  int mask = 0;
+
+  for (int i = 0; i < MAX_SIGNALS; i++)
+    if (_regulatorTypes[i] != Z_regulator_type_none || _sensorApplied[i].type != Z_sensor_type_none)
+      mask |= 1 << i;
+  return mask;
+}
+
+/** Changes the set of acquired channels. A channel that is disabled stops
+  * whatever mode is running on it, and the totalizer does not integrate
+  * across the gap when it is enabled again. Must be called with the driver
+  * locked. */
+void USBelveFlow::setChannelMask(int mask){
+  mask &= (1 << MAX_SIGNALS) - 1;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    int enable = (mask >> i) & 1;
+    if (enable == channelEnabled(i)) continue;
+    if (!enable) abortActiveModes(i);
+    _channels[i].haveLast = 0;
+    _channels[i].settleArmed = 0;
+    setIntegerParam(i, channelEnabled_, enable);
+    callParamCallbacks(i);
+  }
+  _channelMask = mask;
+  setIntegerParam(channelMask_, mask);
+}
+
+/** Publishes whether the correction curve of a channel is in use after it
+  * was changed. An invalid curve passes the raw flow through, which is also
+  * the case while the X and Y of a table have different lengths. The settle
+  * window is restarted as the flow may have changed scale. Must be called
+  * with the driver locked. */
+void USBelveFlow::setCorrection(int addr, int status){
+  setIntegerParam(addr, corrValid_, status == 0);
+  _settleWindow[addr].clear();
+}
+
+/** Fills the history arrays of a channel with the last EF_HIST_SPAN
+  * seconds at EF_HIST_POINTS points at most. Times are relative to the
+  * newest sample. Must be called with the driver locked. */
+void USBelveFlow::queryHistory(int addr){
+  efHistQuery_t q;
+  double span;
+  int points, n;
+
+  getDoubleParam(addr, histSpan_, &span);
+  getIntegerParam(addr, histPoints_, &points);
+  if (points > HIST_MAX_POINTS) points = HIST_MAX_POINTS;
+
+  q.time = _histOut;
+  for (int sig = 0; sig < NUM_STATS_SIGNALS; sig++) {
+    q.min[sig] = _histOut + (1 + 3*sig) * HIST_MAX_POINTS;
+    q.mean[sig] = _histOut + (2 + 3*sig) * HIST_MAX_POINTS;
+    q.max[sig] = _histOut + (3 + 3*sig) * HIST_MAX_POINTS;
+  }
+  n = _tiers[addr].query(span, points, &q);
+
+  doCallbacksFloat64Array(q.time, n, histTime_, addr);
+  for (int sig = 0; sig < NUM_STATS_SIGNALS; sig++) {
+    doCallbacksFloat64Array(q.min[sig], n, histMin_[sig], addr);
+    doCallbacksFloat64Array(q.mean[sig], n, histMean_[sig], addr);
+    doCallbacksFloat64Array(q.max[sig], n, histMax_[sig], addr);
+  }
+}
+
+/** Copies the channel history, oldest sample first, into the caller's
+  * buffers. Must be called with the driver locked. Returns the number of
+  * samples. */
+int USBelveFlow::copyHistory(int addr, double *time, double *pressure, double *flow){
+  sampleHistory_t *ph = &_history[addr];
+  int first = (ph->head - ph->count + HISTORY_LENGTH) % HISTORY_LENGTH;
+  int n1 = HISTORY_LENGTH - first;
+
+  if (n1 > ph->count) n1 = ph->count;
+  memcpy(time, &ph->time[first], n1 * sizeof(double));
+  memcpy(pressure, &ph->pressure[first], n1 * sizeof(double));
+  memcpy(flow, &ph->flow[first], n1 * sizeof(double));
+  memcpy(&time[n1], ph->time, (ph->count - n1) * sizeof(double));
+  memcpy(&pressure[n1], ph->pressure, (ph->count - n1) * sizeof(double));
+  memcpy(&flow[n1], ph->flow, (ph->count - n1) * sizeof(double));
+  return ph->count;
+}
+
+/** Welch PSD of pressure and flow for one channel. Called by the analysis
+  * thread with the driver locked, the lock is released while computing. */
+void USBelveFlow::analyzeChannel(int addr, int nfft){
+  int n = copyHistory(addr, _anaTime, _anaPressure, _anaFlow);
+  int nbins = nfft/2 + 1;
+  double fs, pressPeak, pressRms, flowPeak, flowRms;
+
+  if (n < nfft || _anaTime[n-1] <= _anaTime[0]) return;
+  // Sample rate measured from the timestamps rather than the requested period
+  fs = (n - 1) / (_anaTime[n-1] - _anaTime[0]);
+
+  unlock();
+  efWelchPSD(_anaPressure, n, nfft, fs, _anaPsd, _anaWork);
+  pressPeak = efPeakFrequency(_anaPsd, nfft, fs);
+  pressRms = efRmsFromPSD(_anaPsd, nfft, fs);
+  for (int i = 0; i < nbins; i++) _anaFreq[i] = i * fs / nfft;
+  lock();
+  doCallbacksFloat64Array(_anaFreq, nbins, psdFreq_, addr);
+  doCallbacksFloat64Array(_anaPsd, nbins, psdPress_, addr);
+
+  unlock();
+  efWelchPSD(_anaFlow, n, nfft, fs, _anaPsd, _anaWork);
+  flowPeak = efPeakFrequency(_anaPsd, nfft, fs);
+  flowRms = efRmsFromPSD(_anaPsd, nfft, fs);
+  lock();
+  doCallbacksFloat64Array(_anaPsd, nbins, psdFlow_, addr);
+
+  setDoubleParam(addr, psdRate_, fs);
+  setDoubleParam(addr, psdPressPeak_, pressPeak);
+  setDoubleParam(addr, psdPressRms_, pressRms);
+  setDoubleParam(addr, psdFlowPeak_, flowPeak);
+  setDoubleParam(addr, psdFlowRms_, flowRms);
+  callParamCallbacks(addr);
+}
+
+/** Analysis thread: every psdInterval seconds computes the spectra of the
+  * enabled channels from the acquisition history, and the identification
+  * results as soon as a run has finished. Runs at low priority and
+  * only holds the lock to copy the history and publish the results. */
+void USBelveFlow::analysisThread(){
+  double interval;
+  int nfft, enable;
+
+  lock();
+  while (!_exiting) {
+    getDoubleParam(psdInterval_, &interval);
+    if (interval < 0.1) interval = 0.1;
+    unlock();
+    epicsEventWaitWithTimeout(_analysisEvent, interval);
+    lock();
+    if (_exiting) break;
+    if (_sysIdState == sysIdAnalyzing) analyzeSysId();
+    getIntegerParam(psdLength_, &nfft);
+    for (int i = 0; i < MAX_SIGNALS; i++) {
+      getIntegerParam(i, psdEnable_, &enable);
+      if (enable && channelEnabled(i)) analyzeChannel(i, nfft);
+    }
+  }
+  unlock();
+  epicsEventSignal(_analysisDoneEvent);
+}
+
+/** Starts a system identification run on one channel. Only one channel can
+  * be under test at a time. */
+int USBelveFlow::startSysId(int addr){
+  static const char *functionName = "startSysId";
+  double duration, period;
+
+  if (_sysIdState == sysIdRunning || _sysIdState == sysIdAnalyzing) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s::%s port %s, identification already running on channel %d\n",
+              driverName, functionName, this->portName, _sysIdChannel);
+    return -1;
+  }
+  getDoubleParam(addr, sysIdDuration_, &duration);
+  getDoubleParam(pollPeriod_, &period);
+  if (duration <= 0 || duration / period > SYSID_MAX_SAMPLES) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s::%s port %s, duration %f s does not fit in %d samples\n",
+              driverName, functionName, this->portName, duration, SYSID_MAX_SAMPLES);
+    return -1;
+  }
+  abortActiveModes(addr);
+
+  getDoubleParam(addr, sysIdBase_, &_sysIdSetpoint);
+  _sysIdChannel = addr;
+  _sysIdState = sysIdRunning;
+  _sysIdCount = 0;
+  _sysIdStepTime = -1;
+  epicsTimeGetCurrent(&_sysIdStart);
+  setIntegerParam(addr, sysIdState_, sysIdRunning);
+  return applyPressure(addr, _sysIdSetpoint);
+}
+
+void USBelveFlow::stopSysId(sysIdState_t state){
+  int addr = _sysIdChannel;
+  double base;
+
+  if (addr < 0) return;
+  if (_sysIdState == sysIdRunning) {
+    getDoubleParam(addr, sysIdBase_, &base);
+    applyPressure(addr, base);
+  }
+  _sysIdState = state;
+  setIntegerParam(addr, sysIdState_, state);
+  setIntegerParam(addr, sysIdStart_, 0);
+  callParamCallbacks(addr);
+  if (state != sysIdAnalyzing) _sysIdChannel = -1;
+}
+
+/** Excitation and recording, runs every acquisition cycle. Each recorded
+  * sample pairs the flow with the pressure that was applied during the
+  * preceding interval, then the next excitation value is applied. */
+void USBelveFlow::processSysId(int addr, const epicsTimeStamp *now){
+  double t, duration, base, ampl, f0, f1, setpoint;
+  int mode;
+
+  if (addr != _sysIdChannel || _sysIdState != sysIdRunning) return;
+
+  t = epicsTimeDiffInSeconds(now, &_sysIdStart);
+  _sysIdTime[_sysIdCount] = t;
+  _sysIdSetpoints[_sysIdCount] = _sysIdSetpoint;
+  // The flow of every channel is kept to identify the coupling
+  for (int i = 0; i < MAX_SIGNALS; i++)
+    _sysIdFlow[i * SYSID_MAX_SAMPLES + _sysIdCount] = _channels[i].flow;
+  _sysIdCount++;
+
+  getDoubleParam(addr, sysIdDuration_, &duration);
+  if (t >= duration || _sysIdCount >= SYSID_MAX_SAMPLES) {
+    // Estimation is done by the analysis thread
+    stopSysId(sysIdAnalyzing);
+    epicsEventSignal(_analysisEvent);
+    return;
+  }
+
+  getIntegerParam(addr, sysIdMode_, &mode);
+  getDoubleParam(addr, sysIdBase_, &base);
+  getDoubleParam(addr, sysIdAmpl_, &ampl);
+  if (mode == sysIdChirp) {
+    // Linear sweep from f0 to f1 over the duration
+    getDoubleParam(addr, sysIdF0_, &f0);
+    getDoubleParam(addr, sysIdF1_, &f1);
+    setpoint = base + ampl * sin(6.283185307179586 * (f0*t + 0.5*(f1 - f0)*t*t/duration));
+  }
+  else if (t >= SYSID_STEP_FRACTION * duration) {
+    if (_sysIdStepTime < 0) _sysIdStepTime = t;
+    setpoint = base + ampl;
+  }
+  else setpoint = base;
+
+  if (setpoint != _sysIdSetpoint) {
+    _sysIdSetpoint = setpoint;
+    applyPressure(addr, setpoint);
+  }
+}
+
+/** FOPDT and frequency response estimation of the last identification run.
+  * Called by the analysis thread with the driver locked, the lock is
+  * released while computing. */
+void USBelveFlow::analyzeSysId(){
+  int addr = _sysIdChannel;
+  int n = _sysIdCount;
+  int mode, npts = 0, status = -1;
+  double ampl, f0, f1, fs = 0;
+  double *flow = &_sysIdFlow[addr * SYSID_MAX_SAMPLES];
+  double coupling[MAX_SIGNALS];
+  efFOPDT_t model;
+
+  getIntegerParam(addr, sysIdMode_, &mode);
+  getDoubleParam(addr, sysIdAmpl_, &ampl);
+  getDoubleParam(addr, sysIdF0_, &f0);
+  getDoubleParam(addr, sysIdF1_, &f1);
+  unlock();
+
+  if (n > 1 && _sysIdTime[n-1] > _sysIdTime[0])
+    fs = (n - 1) / (_sysIdTime[n-1] - _sysIdTime[0]);
+  if (fs > 0 && mode == sysIdChirp) {
+    int nfft = 16;
+    while (nfft < n) nfft *= 2;
+    npts = efFrequencyResponse(_sysIdSetpoints, flow, n, fs, f0, f1, nfft,
+                               _sysIdWork, _sysIdFreqs, _sysIdMags, _sysIdPhases,
+                               SYSID_MAX_POINTS);
+    status = efFitFrequencyResponse(_sysIdFreqs, _sysIdMags, _sysIdPhases, npts, &model);
+  }
+  else if (fs > 0 && _sysIdStepTime >= 0) {
+    status = efFitStep(_sysIdTime, flow, n, _sysIdStepTime, ampl, &model);
+    if (status == 0) {
+      // Static gain from this channel's pressure to every channel's flow,
+      // this is column addr of the coupling matrix
+      for (int i = 0; i < MAX_SIGNALS; i++) {
+        const double *y = &_sysIdFlow[i * SYSID_MAX_SAMPLES];
+        double y0 = 0.0, yInf = 0.0;
+        int nBase = 0, nFinal = 0;
+        for (int k = 0; k < n && _sysIdTime[k] < _sysIdStepTime; k++, nBase++) y0 += y[k];
+        for (int k = n - n/5; k < n; k++, nFinal++) yInf += y[k];
+        coupling[i] = (nBase > 0 && nFinal > 0) ? (yInf/nFinal - y0/nBase) / ampl : 0.0;
+      }
+      // Frequency response of the fitted model, log spaced up to Nyquist
+      double fmin = fs / n, fmax = fs / 2;
+      npts = SYSID_MAX_POINTS;
+      for (int i = 0; i < npts; i++)
+        _sysIdFreqs[i] = fmin * pow(fmax / fmin, (double)i / (npts - 1));
+      efModelResponse(&model, _sysIdFreqs, npts, _sysIdMags, _sysIdPhases);
+    }
+  }
+
+  lock();
+  doCallbacksFloat64Array(_sysIdTime, n, sysIdTimeData_, addr);
+  doCallbacksFloat64Array(_sysIdSetpoints, n, sysIdSetpointData_, addr);
+  doCallbacksFloat64Array(flow, n, sysIdFlowData_, addr);
+  if (status == 0 && mode != sysIdChirp) {
+    for (int i = 0; i < MAX_SIGNALS; i++) _mimoMatrix[i][addr] = coupling[i];
+    doCallbacksFloat64Array(&_mimoMatrix[0][0], MAX_SIGNALS * MAX_SIGNALS, mimoMatrix_, 0);
+  }
+  if (status == 0) {
+    setDoubleParam(addr, sysIdGain_, model.gain);
+    setDoubleParam(addr, sysIdDeadTime_, model.deadTime);
+    setDoubleParam(addr, sysIdTau_, model.tau);
+    // The identified model becomes the regulator's process model
+    setDoubleParam(addr, modelGain_, model.gain);
+    setDoubleParam(addr, modelTau_, model.tau);
+    setDoubleParam(addr, modelDeadTime_, model.deadTime);
+    _channels[addr].smithActive = 0;
+    doCallbacksFloat64Array(_sysIdFreqs, npts, sysIdFreq_, addr);
+    doCallbacksFloat64Array(_sysIdMags, npts, sysIdMag_, addr);
+    doCallbacksFloat64Array(_sysIdPhases, npts, sysIdPhase_, addr);
+  }
+  stopSysId((status == 0) ? sysIdDone : sysIdFailed);
+}
+
+/** Stops whatever is driving the pressure of a channel: dose, system
+  * identification, auto-tuning or regulator. Called before a new mode is
+  * started and when the pressure is set by hand. */
+void USBelveFlow::abortActiveModes(int addr){
+  channelState_t *pch = &_channels[addr];
+
+  if (pch->doseState == doseRunning || pch->doseState == doseRamping)
+    stopDose(addr, doseAborted);
+  if (addr == _sysIdChannel && _sysIdState == sysIdRunning)
+    stopSysId(sysIdAborted);
+  if (pch->tuneState == tuneRunning) {
+    pch->tuneWasRegulating = 0;
+    stopTune(addr, tuneAborted);
+  }
+  if (pch->regEnabled) enableRegulator(addr, 0);
+  stopRamp(addr);
+}
+
+/** A pressure setpoint from the user, the command queue or the sequencer.
+  * It takes over from the dose, identification, tuning or regulator running
+  * on this channel. Without slew rate and acceleration limits it is applied
+  * at once, otherwise the acquisition thread ramps towards it. A new target
+  * during a ramp keeps the current slope, so there is no step in the rate.
+  * Must be called with the driver locked. */
+int USBelveFlow::commandPressure(int addr, double value){
+  channelState_t *pch = &_channels[addr];
+  double rate, accel;
+  int ramping = pch->rampActive;
+
+  pch->rampActive = 0;
+  abortActiveModes(addr);
+
+  getDoubleParam(addr, slewRate_, &rate);
+  getDoubleParam(addr, slewAccel_, &accel);
+  if (rate <= 0 && accel <= 0) {
+    setIntegerParam(addr, rampActive_, 0);
+    setDoubleParam(addr, rampProgress_, 100.0);
+    armSettle(addr);
+    return applyPressure(addr, value);
+  }
+
+  // EF_SET_PRESSURE holds the target for the whole ramp, the moving
+  // setpoint is published in EF_SETPOINT
+  setDoubleParam(addr, setPressure_, value);
+  if (!ramping) pch->rampVelocity = 0.0;
+  pch->rampStart = pch->setpoint;
+  pch->rampTarget = value;
+  pch->rampActive = 1;
+  setIntegerParam(addr, rampActive_, 1);
+  setDoubleParam(addr, rampProgress_, 0.0);
+  return 0;
+}
+
+void USBelveFlow::stopRamp(int addr){
+  channelState_t *pch = &_channels[addr];
+
+  if (!pch->rampActive) return;
+  pch->rampActive = 0;
+  pch->rampVelocity = 0.0;
+  setIntegerParam(addr, rampActive_, 0);
+  // The ramp stops where it is, the target is dropped
+  setDoubleParam(addr, setPressure_, pch->setpoint);
+}
+
+/** Moves the setpoint one acquisition period towards the ramp target.
+  * The slope is limited to EF_SLEW_RATE and its change to EF_SLEW_ACCEL, the
+  * slope is reduced in time to stop at the target, so the pressure follows
+  * an S-curve. A limit of 0 means unlimited. */
+void USBelveFlow::processRamp(int addr, double period){
+  channelState_t *pch = &_channels[addr];
+  double rate, accel, error, dist, velocity, change, value, progress;
+
+  if (!pch->rampActive) return;
+  getDoubleParam(addr, slewRate_, &rate);
+  getDoubleParam(addr, slewAccel_, &accel);
+
+  error = pch->rampTarget - pch->setpoint;
+  dist = fabs(error);
+  // Fastest slope that can still stop at the target. The braking limit is
+  // the discrete time form of sqrt(2*accel*dist), which lags by a period
+  // and would end the ramp with a jump in the slope.
+  velocity = dist / period;
+  if (rate > 0 && velocity > rate) velocity = rate;
+  if (accel > 0) {
+    double brake = accel * period * (sqrt(0.25 + 2.0 * dist / (accel * period * period)) - 0.5);
+    if (velocity > brake) velocity = brake;
+  }
+  if (error < 0) velocity = -velocity;
+
+  change = velocity - pch->rampVelocity;
+  if (accel > 0) {
+    if (change > accel * period) change = accel * period;
+    if (change < -accel * period) change = -accel * period;
+  }
+  pch->rampVelocity += change;
+  value = pch->setpoint + pch->rampVelocity * period;
+
+  // Finished when the target is reached or passed
+  if ((error >= 0 && value >= pch->rampTarget) || (error <= 0 && value <= pch->rampTarget)) {
+    value = pch->rampTarget;
+    pch->rampActive = 0;
+    pch->rampVelocity = 0.0;
+    setIntegerParam(addr, rampActive_, 0);
+    armSettle(addr);
+  }
+  applyPressure(addr, value);
+
+  if (!pch->rampActive || pch->rampTarget == pch->rampStart) progress = 100.0;
+  else progress = 100.0 * (value - pch->rampStart) / (pch->rampTarget - pch->rampStart);
+  if (progress < 0) progress = 0;
+  setDoubleParam(addr, rampProgress_, progress);
+}
+
+/** Enables or disables the PI flow regulator. The integrator is preset to
+  * the current pressure so that enabling it does not bump the output. */
+void USBelveFlow::enableRegulator(int addr, int enable){
+  channelState_t *pch = &_channels[addr];
+  double pressure;
+
+  if (enable && !pch->regEnabled) {
+    pressure = pch->setpoint;
+    pch->regIntegral = pressure;
+    pch->regOutput = pressure;
+    pch->smithActive = 0;
+  }
+  pch->regEnabled = enable ? 1 : 0;
+  setIntegerParam(addr, regEnable_, pch->regEnabled);
+}
+
+/** PI flow regulator output for one channel, updates the integrator.
+  * The integrator is clamped to the output limits (anti-windup). */
+double USBelveFlow::regulatorOutput(int addr, double period){
+  channelState_t *pch = &_channels[addr];
+  double setpoint, kp, ki, outMin, outMax, feedback, error, output;
+
+  getDoubleParam(addr, flowSetpoint_, &setpoint);
+  getDoubleParam(addr, regKp_, &kp);
+  getDoubleParam(addr, regKi_, &ki);
+  getDoubleParam(addr, regOutMin_, &outMin);
+  getDoubleParam(addr, regOutMax_, &outMax);
+
+  feedback = pch->flow + smithCorrection(addr, period);
+  setDoubleParam(addr, regFeedback_, feedback);
+  error = setpoint - feedback;
+  pch->regIntegral += ki * error * period;
+  if (pch->regIntegral > outMax) pch->regIntegral = outMax;
+  if (pch->regIntegral < outMin) pch->regIntegral = outMin;
+
+  output = kp * error + pch->regIntegral;
+  if (output > outMax) output = outMax;
+  if (output < outMin) output = outMin;
+  updateSmith(addr, output, period);
+  return output;
+}
+
+/** Updates the steady state pressure to flow model of a channel. Only
+  * samples taken while the flow is settled (see processSettle) are used so
+  * that the transport delay does not bias the fit. */
+void USBelveFlow::learnFlowModel(int addr){
+  channelState_t *pch = &_channels[addr];
+  double forget;
+
+  if (!pch->settled) return;
+  getDoubleParam(addr, ffForget_, &forget);
+  if (forget <= 0.5 || forget > 1.0) forget = 1.0;
+  _flowModel[addr].add(pch->pressure, pch->flow, forget);
+  setDoubleParam(addr, ffSlope_, _flowModel[addr].slope());
+  setDoubleParam(addr, ffOffset_, _flowModel[addr].offset());
+  setIntegerParam(addr, ffSamples_, _flowModel[addr].count());
+}
+
+/** On a flow setpoint change the regulator integrator is set to the
+  * pressure the learned model predicts for the new setpoint, so the output
+  * jumps there at once and the feedback only trims the remaining error.
+  * Only used by the independent regulator, not by the decoupled one. */
+void USBelveFlow::feedForward(int addr){
+  channelState_t *pch = &_channels[addr];
+  EFLinearRLS *pmodel = &_flowModel[addr];
+  double setpoint, pressure, outMin, outMax;
+  int enable;
+
+  getIntegerParam(addr, ffEnable_, &enable);
+  if (!enable || !pch->regEnabled || _mimoEnabled) return;
+  if (pmodel->count() < FF_MIN_SAMPLES || fabs(pmodel->slope()) < 1e-9) return;
+
+  getDoubleParam(addr, flowSetpoint_, &setpoint);
+  getDoubleParam(addr, regOutMin_, &outMin);
+  getDoubleParam(addr, regOutMax_, &outMax);
+  pressure = (setpoint - pmodel->offset()) / pmodel->slope();
+  if (pressure > outMax) pressure = outMax;
+  if (pressure < outMin) pressure = outMin;
+
+  pch->regIntegral = pressure;
+  pch->regOutput = pressure;
+  setDoubleParam(addr, ffPressure_, pressure);
+  applyPressure(addr, pressure);
+}
+
+/** Starts the Smith predictor model in steady state at the given output */
+void USBelveFlow::resetSmith(int addr, double output){
+  channelState_t *pch = &_channels[addr];
+  double gain;
+
+  getDoubleParam(addr, modelGain_, &gain);
+  pch->smithModel = gain * output;
+  for (int k = 0; k < SMITH_MAX_DELAY; k++) _smithDelay[addr][k] = pch->smithModel;
+  pch->smithHead = 0;
+  pch->smithActive = 1;
+}
+
+/** Smith predictor correction added to the measured flow: the undelayed
+  * model output minus the delayed one. The loop then reacts to the
+  * predicted flow instead of waiting for the transport delay. */
+double USBelveFlow::smithCorrection(int addr, double period){
+  channelState_t *pch = &_channels[addr];
+  double deadTime;
+  int enable, delay;
+
+  getIntegerParam(addr, smithEnable_, &enable);
+  if (!enable) return 0.0;
+  if (!pch->smithActive) resetSmith(addr, pch->regOutput);
+
+  getDoubleParam(addr, modelDeadTime_, &deadTime);
+  delay = (int)(deadTime / period + 0.5);
+  if (delay < 0) delay = 0;
+  if (delay > SMITH_MAX_DELAY - 1) delay = SMITH_MAX_DELAY - 1;
+  if (delay == 0) return 0.0;
+  return pch->smithModel - _smithDelay[addr][(pch->smithHead - delay + SMITH_MAX_DELAY) % SMITH_MAX_DELAY];
+}
+
+/** Advances the first order model by one cycle with the new output and
+  * pushes it into the delay line */
+void USBelveFlow::updateSmith(int addr, double output, double period){
+  channelState_t *pch = &_channels[addr];
+  double gain, tau, alpha;
+  int enable;
+
+  getIntegerParam(addr, smithEnable_, &enable);
+  if (!enable || !pch->smithActive) return;
+
+  getDoubleParam(addr, modelGain_, &gain);
+  getDoubleParam(addr, modelTau_, &tau);
+  alpha = (tau > 0) ? 1.0 - exp(-period / tau) : 1.0;
+  // The delay line holds the model output before each update, so slot
+  // head-d is the model output d cycles ago
+  _smithDelay[addr][pch->smithHead] = pch->smithModel;
+  pch->smithHead = (pch->smithHead + 1) % SMITH_MAX_DELAY;
+  pch->smithModel += alpha * (gain * output - pch->smithModel);
+}
+
+/** Independent (SISO) PI flow regulator, runs every acquisition cycle on
+  * the fresh flow sample unless the decoupled controller is enabled. */
+void USBelveFlow::processRegulator(int addr, double period){
+  channelState_t *pch = &_channels[addr];
+  double output;
+
+  if (!pch->regEnabled || _mimoEnabled) return;
+
+  output = regulatorOutput(addr, period);
+  if (output != pch->regOutput) {
+    pch->regOutput = output;
+    applyPressure(addr, output);
+  }
+}
+
+/** Static decoupler D = Ga^-1 diag(Ga), Ga being the coupling matrix
+  * restricted to the active channels. With p = D v each loop sees only its
+  * own diagonal gain, so gains tuned per channel stay valid. Returns -1 if
+  * Ga is singular. decoupler is MAX_SIGNALS x MAX_SIGNALS, rows and columns
+  * of inactive channels are zero. */
+int USBelveFlow::computeDecoupler(const int *active, double *decoupler){
+  double a[MAX_SIGNALS][2*MAX_SIGNALS];
+  int index[MAX_SIGNALS];
+  int n = 0;
+
+  for (int i = 0; i < MAX_SIGNALS; i++)
+    if (active[i]) index[n++] = i;
+  memset(decoupler, 0, MAX_SIGNALS * MAX_SIGNALS * sizeof(double));
+  if (n == 0) return 0;
+
+  // Gauss-Jordan inversion of [Ga | I] with partial pivoting
+  for (int r = 0; r < n; r++)
+    for (int c = 0; c < n; c++) {
+      a[r][c] = _mimoMatrix[index[r]][index[c]];
+      a[r][n+c] = (r == c) ? 1.0 : 0.0;
+    }
+  for (int c = 0; c < n; c++) {
+    int pivot = c;
+    for (int r = c+1; r < n; r++)
+      if (fabs(a[r][c]) > fabs(a[pivot][c])) pivot = r;
+    if (fabs(a[pivot][c]) < MIMO_MIN_PIVOT) return -1;
+    if (pivot != c)
+      for (int k = 0; k < 2*n; k++) {
+        double t = a[c][k]; a[c][k] = a[pivot][k]; a[pivot][k] = t;
+      }
+    double scale = a[c][c];
+    for (int k = 0; k < 2*n; k++) a[c][k] /= scale;
+    for (int r = 0; r < n; r++) {
+      if (r == c || a[r][c] == 0) continue;
+      double f = a[r][c];
+      for (int k = 0; k < 2*n; k++) a[r][k] -= f * a[c][k];
+    }
+  }
+  for (int r = 0; r < n; r++)
+    for (int c = 0; c < n; c++)
+      decoupler[index[r]*MAX_SIGNALS + index[c]] = a[r][n+c] * _mimoMatrix[index[c]][index[c]];
+  return 0;
+}
+
+/** Enables the decoupled controller for all channels whose regulator is on.
+  * The integrators are preset to v = D^-1 p, i.e. diag(G)^-1 G p, so that
+  * switching from independent loops does not bump the pressures. */
+void USBelveFlow::enableMimo(int enable){
+  if (enable && !_mimoEnabled) {
+    for (int i = 0; i < MAX_SIGNALS; i++) {
+      double v = 0.0;
+      if (!_channels[i].regEnabled || _mimoMatrix[i][i] == 0) continue;
+      for (int j = 0; j < MAX_SIGNALS; j++)
+        if (_channels[j].regEnabled) v += _mimoMatrix[i][j] * _channels[j].regOutput;
+      _channels[i].regIntegral = v / _mimoMatrix[i][i];
+    }
+  }
+  _mimoEnabled = enable ? 1 : 0;
+  setIntegerParam(mimoEnable_, _mimoEnabled);
+  setIntegerParam(mimoStatus_, _mimoEnabled ? mimoActive : mimoOff);
+}
+
+/** Decoupled controller, runs every acquisition cycle after the channels
+  * have been processed. The per-channel PI outputs are combined through the
+  * decoupler and all pressures are written with one OB1_Set_All_Press. */
+void USBelveFlow::processMimo(double period){
+  int active[MAX_SIGNALS];
+  double decoupler[MAX_SIGNALS * MAX_SIGNALS];
+  double v[MAX_SIGNALS], pressures[MAX_SIGNALS];
+  double outMin, outMax;
+  int nActive = 0;
+
+  if (!_mimoEnabled) return;
+
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    active[i] = _channels[i].regEnabled;
+    nActive += active[i];
+  }
+  if (nActive == 0) return;
+  if (computeDecoupler(active, decoupler)) {
+    setIntegerParam(mimoStatus_, mimoSingular);
+    return;
+  }
+  setIntegerParam(mimoStatus_, mimoActive);
+
+  for (int i = 0; i < MAX_SIGNALS; i++)
+    v[i] = active[i] ? regulatorOutput(i, period) : 0.0;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    if (!active[i]) {
+      pressures[i] = _channels[i].setpoint;
+      continue;
+    }
+    pressures[i] = 0.0;
+    for (int j = 0; j < MAX_SIGNALS; j++)
+      pressures[i] += decoupler[i*MAX_SIGNALS + j] * v[j];
+    getDoubleParam(i, regOutMin_, &outMin);
+    getDoubleParam(i, regOutMax_, &outMax);
+    if (pressures[i] > outMax) pressures[i] = outMax;
+    if (pressures[i] < outMin) pressures[i] = outMin;
+    _channels[i].regOutput = pressures[i];
+  }
+  applyAllPressure(pressures);
+}
+
+/** Starts a relay (Astrom-Hagglund) experiment. The pressure is switched
+  * between bias +/- TuneAmpl, the bias being the current pressure, each
+  * time the flow crosses the flow setpoint by more than TuneHyst. */
+int USBelveFlow::startTune(int addr){
+  static const char *functionName = "startTune";
+  channelState_t *pch = &_channels[addr];
+  double ampl, setpoint;
+  int wasRegulating = pch->regEnabled;
+
+  getDoubleParam(addr, tuneAmpl_, &ampl);
+  if (ampl <= 0) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+              "%s::%s port %s, relay amplitude must be > 0\n",
+              driverName, functionName, this->portName);
+    return -1;
+  }
+  abortActiveModes(addr);
+
+  pch->tuneBias = pch->setpoint;
+  getDoubleParam(addr, flowSetpoint_, &setpoint);
+  pch->tuneWasRegulating = wasRegulating;
+  pch->tuneHigh = (pch->flow < setpoint);
+  pch->tuneCycles = -1;         // the first cycle is a transient, not measured
+  pch->tuneCycleMin = pch->tuneCycleMax = pch->flow;
+  pch->tunePeriodSum = 0.0;
+  pch->tuneAmplSum = 0.0;
+  epicsTimeGetCurrent(&pch->tuneStart);
+  pch->tuneState = tuneRunning;
+  setIntegerParam(addr, tuneState_, tuneRunning);
+  return applyPressure(addr, pch->tuneBias + (pch->tuneHigh ? ampl : -ampl));
+}
+
+void USBelveFlow::stopTune(int addr, tuneState_t state){
+  channelState_t *pch = &_channels[addr];
+
+  if (pch->tuneState == tuneRunning) applyPressure(addr, pch->tuneBias);
+  pch->tuneState = state;
+  setIntegerParam(addr, tuneState_, state);
+  setIntegerParam(addr, tuneStart_, 0);
+  if (pch->tuneWasRegulating) {
+    pch->tuneWasRegulating = 0;
+    enableRegulator(addr, 1);
+  }
+}
+
+/** Relay experiment, runs every acquisition cycle. The ultimate period is
+  * the time between low to high switches and the oscillation amplitude is
+  * half the peak to peak flow of each cycle. Once TuneCycles cycles have
+  * been measured the ultimate gain is Ku = 4d/(pi sqrt(a^2 - h^2)) and the
+  * Ziegler-Nichols PI gains Kp = 0.45 Ku, Ki = Kp / (Pu/1.2) are loaded
+  * into the regulator. */
+void USBelveFlow::processTune(int addr, const epicsTimeStamp *now){
+  channelState_t *pch = &_channels[addr];
+  double ampl, hyst, setpoint, timeout, outMin, outMax, output;
+  int cycles;
+
+  if (pch->tuneState != tuneRunning) return;
+
+  getDoubleParam(addr, tuneAmpl_, &ampl);
+  getDoubleParam(addr, tuneHyst_, &hyst);
+  getDoubleParam(addr, flowSetpoint_, &setpoint);
+  getDoubleParam(addr, tuneTimeout_, &timeout);
+  getIntegerParam(addr, tuneCycles_, &cycles);
+  if (cycles < 1) cycles = 1;
+
+  if (epicsTimeDiffInSeconds(now, &pch->tuneStart) > timeout) {
+    stopTune(addr, tuneFailed);
+    return;
+  }
+
+  if (pch->flow < pch->tuneCycleMin) pch->tuneCycleMin = pch->flow;
+  if (pch->flow > pch->tuneCycleMax) pch->tuneCycleMax = pch->flow;
+
+  if (!pch->tuneHigh && pch->flow < setpoint - hyst) {
+    // Low to high switch closes one cycle
+    pch->tuneHigh = 1;
+    if (pch->tuneCycles >= 0) {
+      pch->tunePeriodSum += epicsTimeDiffInSeconds(now, &pch->tuneLastSwitch);
+      pch->tuneAmplSum += 0.5 * (pch->tuneCycleMax - pch->tuneCycleMin);
+    }
+    pch->tuneCycles++;
+    pch->tuneLastSwitch = *now;
+    pch->tuneCycleMin = pch->tuneCycleMax = pch->flow;
+  }
+  else if (pch->tuneHigh && pch->flow > setpoint + hyst) {
+    pch->tuneHigh = 0;
+  }
+  else return;
+
+  if (pch->tuneCycles >= cycles) {
+    double pu = pch->tunePeriodSum / cycles;
+    double a = pch->tuneAmplSum / cycles;
+    double ku, kp;
+    if (a <= hyst || pu <= 0) {
+      stopTune(addr, tuneFailed);
+      return;
+    }
+    ku = 4.0 * ampl / (3.141592653589793 * sqrt(a*a - hyst*hyst));
+    kp = 0.45 * ku;
+    setDoubleParam(addr, tuneKu_, ku);
+    setDoubleParam(addr, tunePu_, pu);
+    setDoubleParam(addr, regKp_, kp);
+    setDoubleParam(addr, regKi_, kp * 1.2 / pu);
+    stopTune(addr, tuneDone);
+    return;
+  }
+
+  getDoubleParam(addr, regOutMin_, &outMin);
+  getDoubleParam(addr, regOutMax_, &outMax);
+  output = pch->tuneBias + (pch->tuneHigh ? ampl : -ampl);
+  if (output > outMax) output = outMax;
+  if (output < outMin) output = outMin;
+  applyPressure(addr, output);
+}
+
+/** Adds time-tagged commands to the queue. Entries are separated by ';' or
+  * new lines, each one is
+  *     P|F <channel 0-3> <value> <time>
+  * P sets the pressure (mbar), F the flow setpoint (ul/min). time is the
+  * execution time in seconds past the POSIX epoch, or +seconds from now.
+  * The whole text is parsed before anything is queued. Returns -1, with
+  * nothing queued, if an entry could not be parsed or the entries do not
+  * fit in the queue. */
+int USBelveFlow::queueCommands(const char *text){
+  char copy[4096];
+  char *entry, *save = 0;
+  epicsTimeStamp now;
+  timedCommand_t parsed[CMD_QUEUE_SIZE];
+  int numParsed = 0;
+
+  // A truncated text could end in a shortened but valid entry
+  if (strlen(text) >= sizeof(copy)) return -1;
+  epicsTimeGetCurrent(&now);
+  strncpy(copy, text, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = '\0';
+
+  for (entry = epicsStrtok_r(copy, ";\n", &save); entry; entry = epicsStrtok_r(0, ";\n", &save)) {
+    timedCommand_t cmd;
+    char kind, timeText[64];
+    double when;
+
+    while (*entry == ' ' || *entry == '\t') entry++;
+    if (*entry == '\0') continue;
+    if (sscanf(entry, " %c %d %lf %63s", &kind, &cmd.channel, &cmd.value, timeText) != 4) return -1;
+    if (kind == 'P' || kind == 'p') cmd.kind = cmdPressure;
+    else if (kind == 'F' || kind == 'f') cmd.kind = cmdFlow;
+    else return -1;
+    if (cmd.channel < 0 || cmd.channel >= MAX_SIGNALS) return -1;
+    if (_numCommands + numParsed >= CMD_QUEUE_SIZE) return -1;
+
+    if (timeText[0] == '+') {
+      if (sscanf(timeText + 1, "%lf", &when) != 1) return -1;
+      cmd.due = now;
+      epicsTimeAddSeconds(&cmd.due, when);
+    }
+    else {
+      if (sscanf(timeText, "%lf", &when) != 1) return -1;
+      when -= POSIX_TIME_AT_EPICS_EPOCH;
+      if (when < 0) return -1;
+      cmd.due.secPastEpoch = (epicsUInt32)when;
+      cmd.due.nsec = (epicsUInt32)((when - cmd.due.secPastEpoch) * 1e9);
+    }
+    parsed[numParsed++] = cmd;
+  }
+
+  for (int k = 0; k < numParsed; k++) {
+    timedCommand_t *pc = &parsed[k];
+    int i;
+
+    pc->id = _nextCommandId++;
+    // Insertion keeps the queue sorted, equal times run in arrival order
+    for (i = _numCommands; i > 0 && epicsTimeLessThan(&pc->due, &_commands[i-1].due); i--)
+      _commands[i] = _commands[i-1];
+    _commands[i] = *pc;
+    _numCommands++;
+  }
+  setIntegerParam(cmdPending_, _numCommands);
+  return 0;
+}
+
+/** Executes every queued command whose time has come. The applied time is
+  * taken right after the USB call returns and the lateness relative to the
+  * requested time is logged. Must be called with the driver locked. */
+void USBelveFlow::executeCommands(){
+  epicsTimeStamp now, applied;
+  int executed = 0;
+
+  epicsTimeGetCurrent(&now);
+  while (_numCommands > 0 && !epicsTimeLessThan(&now, &_commands[0].due)) {
+    timedCommand_t cmd = _commands[0];
+    double lateness, appliedTime;
+    int addr = cmd.channel;
+
+    _numCommands--;
+    memmove(&_commands[0], &_commands[1], _numCommands * sizeof(timedCommand_t));
+
+    if (cmd.kind == cmdPressure) {
+      commandPressure(addr, cmd.value);
+    }
+    else {
+      setDoubleParam(addr, flowSetpoint_, cmd.value);
+      feedForward(addr);
+    }
+    epicsTimeGetCurrent(&applied);
+    lateness = epicsTimeDiffInSeconds(&applied, &cmd.due);
+    appliedTime = applied.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + applied.nsec * 1e-9;
+
+    if (_cmdLogCount == CMD_LOG_SIZE) {
+      memmove(&_cmdLogId[0], &_cmdLogId[1], (CMD_LOG_SIZE - 1) * sizeof(double));
+      memmove(&_cmdLogTime[0], &_cmdLogTime[1], (CMD_LOG_SIZE - 1) * sizeof(double));
+      memmove(&_cmdLogLateness[0], &_cmdLogLateness[1], (CMD_LOG_SIZE - 1) * sizeof(double));
+      _cmdLogCount--;
+    }
+    _cmdLogId[_cmdLogCount] = cmd.id;
+    _cmdLogTime[_cmdLogCount] = appliedTime;
+    _cmdLogLateness[_cmdLogCount] = lateness;
+    _cmdLogCount++;
+
+    setIntegerParam(cmdLastId_, cmd.id);
+    setDoubleParam(cmdLastTime_, appliedTime);
+    setDoubleParam(cmdLastLateness_, lateness);
+    callParamCallbacks(addr);
+    executed++;
+    epicsTimeGetCurrent(&now);
+  }
+  if (executed) {
+    setIntegerParam(cmdPending_, _numCommands);
+    doCallbacksFloat64Array(_cmdLogId, _cmdLogCount, cmdLogId_, 0);
+    doCallbacksFloat64Array(_cmdLogTime, _cmdLogCount, cmdLogTime_, 0);
+    doCallbacksFloat64Array(_cmdLogLateness, _cmdLogCount, cmdLogLateness_, 0);
+    callParamCallbacks();
+  }
+}
+
+/** Parses a sequencer program, one step per line or separated by ';'.
+  *     PRES <ch> <mbar>                      set the pressure
+  *     RAMP <ch> <mbar> <s>                  linear ramp from the current setpoint
+  *     WAITFLOW <ch> <|> <ul/min> [timeout]  wait until flow is below/above
+  *     WAIT <s>                              wait
+  *     TRIG <0|1>                            set the trigger output
+  *     LOOP <step> <count>                   repeat from step (first is 0), 0 forever
+  * Channels are 0 to 3. The program is only replaced if it parses and the
+  * sequencer is not running, errors are reported in EF_SEQ_MESSAGE. */
+int USBelveFlow::loadSequence(const char *text){
+  seqStep_t steps[SEQ_MAX_STEPS];
+  char copy[4096], message[128];
+  char *entry, *save = 0;
+  int length = 0;
+
+  if (_seqState == seqRunning) {
+    setStringParam(seqMessage_, "Sequence is running");
+    return -1;
+  }
+  strncpy(copy, text, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = '\0';
+
+  for (entry = epicsStrtok_r(copy, ";\n", &save); entry; entry = epicsStrtok_r(0, ";\n", &save)) {
+    seqStep_t *st = &steps[length];
+    char op[16], compare[4];
+    int n, ok;
+
+    while (*entry == ' ' || *entry == '\t' || *entry == '\r') entry++;
+    if (*entry == '\0' || *entry == '#') continue;
+    if (length == SEQ_MAX_STEPS) {
+      epicsSnprintf(message, sizeof(message), "More than %d steps", SEQ_MAX_STEPS);
+      setStringParam(seqMessage_, message);
+      return -1;
+    }
+    memset(st, 0, sizeof(*st));
+    if (sscanf(entry, "%15s", op) != 1) op[0] = '\0';
+    if (epicsStrCaseCmp(op, "PRES") == 0) {
+      st->op = seqPres;
+      ok = (sscanf(entry, "%*s %d %lf", &st->channel, &st->value) == 2);
+    }
+    else if (epicsStrCaseCmp(op, "RAMP") == 0) {
+      st->op = seqRamp;
+      ok = (sscanf(entry, "%*s %d %lf %lf", &st->channel, &st->value, &st->time) == 3) && st->time >= 0;
+    }
+    else if (epicsStrCaseCmp(op, "WAITFLOW") == 0) {
+      st->op = seqWaitFlow;
+      // The comparison is required, the timeout is optional
+      compare[0] = '\0';
+      n = sscanf(entry, "%*s %d %3s %lf %lf", &st->channel, compare, &st->value, &st->time);
+      ok = (n >= 3) && (strcmp(compare, "<") == 0 || strcmp(compare, ">") == 0);
+      if (ok) st->above = (compare[0] == '>');
+    }
+    else if (epicsStrCaseCmp(op, "WAIT") == 0) {
+      st->op = seqWait;
+      ok = (sscanf(entry, "%*s %lf", &st->time) == 1) && st->time >= 0;
+    }
+    else if (epicsStrCaseCmp(op, "TRIG") == 0) {
+      st->op = seqTrig;
+      ok = (sscanf(entry, "%*s %lf", &st->value) == 1);
+    }
+    else if (epicsStrCaseCmp(op, "LOOP") == 0) {
+      st->op = seqLoop;
+      ok = (sscanf(entry, "%*s %d %d", &st->target, &st->count) == 2) &&
+           st->target >= 0 && st->target <= length && st->count >= 0;
+    }
+    else ok = 0;
+    if (ok && (st->channel < 0 || st->channel >= MAX_SIGNALS)) ok = 0;
+    if (!ok) {
+      epicsSnprintf(message, sizeof(message), "Step %d: cannot parse '%.60s'", length, entry);
+      setStringParam(seqMessage_, message);
+      return -1;
+    }
+    if (st->op == seqLoop && st->count == 0) {
+      // An endless loop must wait somewhere, or it would write to the OB1
+      // every cycle for ever
+      int waits = 0;
+      for (int k = st->target; k < length; k++)
+        if (steps[k].op == seqWait || steps[k].op == seqWaitFlow || steps[k].op == seqRamp) waits = 1;
+      if (!waits) {
+        epicsSnprintf(message, sizeof(message), "Step %d: endless LOOP without WAIT, WAITFLOW or RAMP", length);
+        setStringParam(seqMessage_, message);
+        return -1;
+      }
+    }
+    length++;
+  }
+
+  memcpy(_seqSteps, steps, length * sizeof(seqStep_t));
+  _seqLength = length;
+  setIntegerParam(seqLength_, length);
+  epicsSnprintf(message, sizeof(message), "Loaded %d steps", length);
+  setStringParam(seqMessage_, message);
+  return 0;
+}
+
+/** Starts the loaded program from the first step, it runs from the next
+  * acquisition on */
+void USBelveFlow::startSequence(){
+  epicsTimeStamp now;
+
+  if (_seqState == seqRunning || _seqLength == 0) return;
+  memset(_seqLoopCount, 0, sizeof(_seqLoopCount));
+  memset(_seqStepTimes, 0, sizeof(_seqStepTimes));
+  epicsTimeGetCurrent(&now);
+  _seqState = seqRunning;
+  setIntegerParam(seqState_, seqRunning);
+  enterStep(0, &now);
+}
+
+void USBelveFlow::stopSequence(seqState_t state){
+  _seqState = state;
+  setIntegerParam(seqState_, state);
+  doCallbacksFloat64Array(_seqStepTimes, _seqLength, seqStepTimes_, 0);
+}
+
+/** Makes step the current one and records its start time */
+void USBelveFlow::enterStep(int step, epicsTimeStamp *now){
+  seqStep_t *st = &_seqSteps[step];
+
+  _seqStep = step;
+  _seqStepStart = *now;
+  _seqStepTimes[step] = now->secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + now->nsec * 1e-9;
+  if (st->op == seqRamp) {
+    abortActiveModes(st->channel);
+    _seqRampStart = _channels[st->channel].setpoint;
+  }
+  setIntegerParam(seqStep_, step);
+  setDoubleParam(seqStepTime_, _seqStepTimes[step]);
+}
+
+/** Runs the sequencer for one acquisition cycle. Steps that complete
+  * immediately are chained, so the next step starts in the same cycle. */
+void USBelveFlow::processSequence(epicsTimeStamp *now){
+  int n, next, done, back, failed;
+
+  if (_seqState != seqRunning) return;
+
+  for (n = 0; n < SEQ_MAX_STEPS; n++) {
+    seqStep_t *st = &_seqSteps[_seqStep];
+    double elapsed = epicsTimeDiffInSeconds(now, &_seqStepStart);
+    double flow;
+
+    next = _seqStep + 1;
+    done = 1;
+    switch (st->op) {
+      case seqPres:
+        commandPressure(st->channel, st->value);
+        break;
+      case seqRamp:
+        if (elapsed < st->time) {
+          applyPressure(st->channel, _seqRampStart + (st->value - _seqRampStart) * elapsed / st->time);
+          done = 0;
+        }
+        else {
+          applyPressure(st->channel, st->value);
+          armSettle(st->channel);
+        }
+        break;
+      case seqWaitFlow:
+        flow = _channels[st->channel].flow;
+        done = st->above ? (flow > st->value) : (flow < st->value);
+        if (!done && st->time > 0 && elapsed >= st->time) {
+          stopSequence(seqTimeout);
+          return;
+        }
+        break;
+      case seqWait:
+        done = (elapsed >= st->time);
+        break;
+      case seqTrig:
+        epicsMutexMustLock(_ob1Lock);
+        failed = OB1_Set_Trig(_MyOB1_ID, st->value != 0);
+        epicsMutexUnlock(_ob1Lock);
+        if (failed) {
+          stopSequence(seqFailed);
+          return;
+        }
+        break;
+      case seqLoop:
+        _seqLoopCount[_seqStep]++;
+        if (st->count == 0 || _seqLoopCount[_seqStep] < st->count) next = st->target;
+        else _seqLoopCount[_seqStep] = 0;
+        break;
+    }
+    if (!done) return;
+    if (next >= _seqLength) {
+      stopSequence(seqDone);
+      return;
+    }
+    back = (next <= _seqStep);
+    enterStep(next, now);
+    // A jump back ends the cycle, so a loop body runs at most once per cycle
+    if (back) return;
+  }
+}
+
+/** Publishes the sample just acquired to the shared memory ring */
+void USBelveFlow::exportSample(epicsTimeStamp *now){
+  efShmSample_t sample;
+
+  if (!_shm.isOpen()) return;
+  sample.index = 0;
+  sample.time = now->secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + now->nsec * 1e-9;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    int enabled = channelEnabled(i);
+    sample.pressure[i] = enabled ? _channels[i].pressure : epicsNAN;
+    sample.flow[i] = enabled ? _channels[i].flow : epicsNAN;
+    sample.setpoint[i] = _channels[i].setpoint;
+  }
+  _shm.write(&sample);
+  setIntegerParam(shmCount_, (int)_shm.count());
+}
+
+/** Publishes the state read from the checkpoint. Volumes are restored at
+  * once, regulators and ramps only when the IOC is running, as they need
+  * the gains and rates restored by the records. */
+void USBelveFlow::restoreCheckpoint(){
+  static const char *functionName = "restoreCheckpoint";
+  epicsTimeStamp now;
+  double age;
+
+  epicsTimeGetCurrent(&now);
+  age = now.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + now.nsec * 1e-9 - _restored.time;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    efCheckpointChannel_t *pc = &_restored.channel[i];
+    _channels[i].volume = pc->volume;
+    _channels[i].doseStartVolume = pc->doseStartVolume;
+    setDoubleParam(i, volume_, pc->volume);
+    setDoubleParam(i, doseVolume_, pc->volume - pc->doseStartVolume);
+    setDoubleParam(i, flowSetpoint_, pc->flowSetpoint);
+    setIntegerParam(i, regEnable_, pc->regEnabled);
+    callParamCallbacks(i);
+  }
+  _haveRestored = 1;
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s:%s, port %s, control state saved %.1f s ago restored\n",
+            driverName, functionName, this->portName, age);
+}
+
+/** Called once the IOC is running: resumes the regulators and ramps that
+  * were active when the checkpoint was saved, then starts saving it. */
+void USBelveFlow::resumeControl(){
+  lock();
+  for (int i = 0; _haveRestored && i < MAX_SIGNALS; i++) {
+    efCheckpointChannel_t *pc = &_restored.channel[i];
+    channelState_t *pch = &_channels[i];
+
+    if (!channelEnabled(i) || _regulatorTypes[i] == Z_regulator_type_none) continue;
+    if (pc->regEnabled) {
+      enableRegulator(i, 1);
+      pch->regIntegral = pc->regIntegral;
+      pch->regOutput = pc->regOutput;
+    }
+    else if (pc->rampActive) {
+      pch->rampActive = 1;
+      pch->rampStart = pc->rampStart;
+      pch->rampTarget = pc->rampTarget;
+      pch->rampVelocity = pc->rampVelocity;
+      setIntegerParam(i, rampActive_, 1);
+      setDoubleParam(i, setPressure_, pch->rampTarget);
+    }
+  }
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    setIntegerParam(i, regEnable_, _channels[i].regEnabled);
+    callParamCallbacks(i);
+  }
+  _haveRestored = 0;
+  _checkpointReady = _checkpoint.isOpen();
+  unlock();
+}
+
+/** Saves the control state of every channel. Must be called with the
+  * driver locked. */
+void USBelveFlow::saveCheckpoint(const epicsTimeStamp *now){
+  efCheckpointState_t state;
+
+  if (!_checkpointReady) return;
+  memset(&state, 0, sizeof(state));
+  state.time = now->secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + now->nsec * 1e-9;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    efCheckpointChannel_t *pc = &state.channel[i];
+    channelState_t *pch = &_channels[i];
+
+    pc->setpoint = pch->setpoint;
+    getDoubleParam(i, flowSetpoint_, &pc->flowSetpoint);
+    pc->regEnabled = pch->regEnabled;
+    pc->rampActive = pch->rampActive;
+    pc->regIntegral = pch->regIntegral;
+    pc->regOutput = pch->regOutput;
+    pc->rampStart = pch->rampStart;
+    pc->rampTarget = pch->rampTarget;
+    pc->rampVelocity = pch->rampVelocity;
+    pc->volume = pch->volume;
+    pc->doseStartVolume = pch->doseStartVolume;
+  }
+  _checkpoint.save(&state);
+}
+
+/** One acquisition cycle: reads every channel, runs the per channel
+  * processing and posts the parameters. The samples are stamped with the
+  * time they were read, or with the common time of a group cycle if stamp
+  * is not NULL. Returns 0 if the channels were read. Must be called with
+  * the driver locked. */
+int USBelveFlow::runCycle(const epicsTimeStamp *stamp, double period){
+  epicsTimeStamp now;
+  int failing = _acquireError, status = -1;
+
+  epicsTimeGetCurrent(&now);
+  if (_calibState == calibRunning) {
+    // OB1_Calib owns the controller, nothing is read until it returns
+    updateCalibProgress(&now);
+  }
+  else if ((status = acquire()) == 0) {
+    // The OB1 may have been power cycled, give it its sensors back
+    if (failing && _sensorsReady) replaySensors();
+    if (stamp) now = *stamp;
+    else epicsTimeGetCurrent(&now);
+    setTimeStamp(&now);
+    updateLaneRate(&_analogRate, &now, analogRate_);
+    for (int i = 0; i < MAX_SIGNALS; i++) {
+      if (!channelEnabled(i)) continue;
+      integrateFlow(i, &now);
+      processDose(i, period);
+      processSettle(i, &now, period);
+      learnFlowModel(i);
+      processStats(i, &now);
+      recordHistory(i, &now);
+      processSysId(i, &now);
+      processTune(i, &now);
+      processRamp(i, period);
+      processRegulator(i, period);
+      setDoubleParam(i, readPressure_, _channels[i].pressure);
+      setDoubleParam(i, readSensor_, _channels[i].flow);
+      setDoubleParam(i, flowRaw_, _channels[i].rawFlow);
+      int valid = 1;
+      if (_sensorApplied[i].kind == Z_Sensor_digit_analog_Digital) getIntegerParam(i, sensorValid_, &valid);
+      setParamAlarmStatus(i, readSensor_, valid ? NO_ALARM : READ_ALARM);
+      setParamAlarmSeverity(i, readSensor_, valid ? NO_ALARM : INVALID_ALARM);
+      setDoubleParam(i, volume_, _channels[i].volume);
+    }
+    processMimo(period);
+    processSequence(&now);
+    exportSample(&now);
+    saveCheckpoint(&now);
+  }
+  // Controller wide parameters are on address 0, which is always posted
+  for (int i = 0; i < MAX_SIGNALS; i++)
+    if (channelEnabled(i) || i == 0) callParamCallbacks(i);
+  return status;
+}
+
+/** Acquisition thread: reads every channel each poll period, integrates the
+  * flow and runs the dosing state machine. The next wake-up is computed from
+  * the previous one so the period does not drift with the I/O time.
+  * With EF_TICK_ALIGN the cycles start on multiples of the period of the
+  * IOC clock, the same boundaries for every port, and the start of each
+  * acquisition is compared with that of the other ports. */
+void USBelveFlow::pollerThread(){
+  epicsTimeStamp now, next, wake;
+  double period, delay;
+  int align, onTick = 0;
+
+  setIoAffinity("acquisition");
+  epicsTimeGetCurrent(&next);
+  lock();
+  while (!_exiting) {
+    getDoubleParam(pollPeriod_, &period);
+    if (period < 0.001) period = 0.001;
+    getIntegerParam(tickAlign_, &align);
+
+    epicsTimeGetCurrent(&now);
+    if (!epicsTimeLessThan(&now, &next)) {
+      // The cycles of a controller in a group are run by the group port
+      if (!_grouped) {
+        updateJitter(&now, epicsTimeDiffInSeconds(&now, &next));
+        if (align && onTick) {
+          double skew;
+          int ports;
+          reportTick(&next, &now, &skew, &ports);
+          setDoubleParam(tickOffset_, epicsTimeDiffInSeconds(&now, &next));
+          setDoubleParam(tickSkew_, skew);
+          setIntegerParam(tickPorts_, ports);
+        }
+        runCycle(NULL, period);
+      }
+
+      epicsTimeGetCurrent(&now);
+      if (align) {
+        // A cycle that overran skips the ticks it missed
+        nextTick(&next, &now, period);
+        onTick = 1;
+      }
+      else {
+        epicsTimeAddSeconds(&next, period);
+        onTick = 0;
+        if (epicsTimeLessThan(&next, &now)) {
+          // Overrun, restart the schedule from now instead of trying to catch up
+          next = now;
+        }
+      }
+    }
+
+    // Time-tagged commands are executed between acquisitions, the thread
+    // wakes up for whichever comes first
+    if (_calibState != calibRunning) executeCommands();
+    wake = next;
+    if (_numCommands > 0 && epicsTimeLessThan(&_commands[0].due, &wake))
+      wake = _commands[0].due;
+    unlock();
+
+    epicsTimeGetCurrent(&now);
+    delay = epicsTimeDiffInSeconds(&wake, &now);
+    if (delay > 0) epicsEventWaitWithTimeout(_pollerEvent, delay);
+    lock();
+  }
+  unlock();
+  epicsEventSignal(_pollerDoneEvent);
+}
+
+/** Hands the acquisition cycles of this controller to a group port.
+  * Returns -1 if it already belongs to one. */
+int USBelveFlow::joinGroup(){
+  int status = 0;
+
+  lock();
+  if (_grouped) status = -1;
+  else _grouped = 1;
+  unlock();
+  return status;
+}
+
+/** Undoes joinGroup(), the poller acquires again */
+void USBelveFlow::leaveGroup(){
+  lock();
+  _grouped = 0;
+  unlock();
+}
+
+/** Runs one cycle for the group port with its common timestamp and copies
+  * the samples of the 4 channels. A channel that was not read is NaN. */
+int USBelveFlow::groupCycle(const epicsTimeStamp *stamp, double period,
+                            double *pressure, double *flow, double *setpoint){
+  int status;
+
+  lock();
+  // Nothing is read until the controller is initialized
+  status = (_initState == initDone) ? runCycle(stamp, period) : -1;
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    int valid = (status == 0) && channelEnabled(i);
+    pressure[i] = valid ? _channels[i].pressure : epicsNAN;
+    flow[i] = valid ? _channels[i].flow : epicsNAN;
+    setpoint[i] = _channels[i].setpoint;
+  }
+  unlock();
+  return status;
+}
+
+/** Writes the pressures of the channels in mask with one OB1_Set_All_Press,
+  * the other channels keep their setpoint. Like EF_SET_PRESSURE the write
+  * takes the channels out of any active mode, but it is not slew limited.
+  * Returns 1 without writing while the controller is still initializing,
+  * -1 if it failed to initialize or the write failed. */
+int USBelveFlow::groupSetPressures(int mask, const double *pressures){
+  double values[MAX_SIGNALS];
+  int status;
+
+  lock();
+  if (_initState != initDone) {
+    status = (_initState == initRunning) ? 1 : -1;
+    unlock();
+    return status;
+  }
+  for (int i = 0; i < MAX_SIGNALS; i++) {
+    values[i] = _channels[i].setpoint;
+    if (!((mask >> i) & 1)) continue;
+    abortActiveModes(i);
+    setDoubleParam(i, rampProgress_, 100.0);
+    armSettle(i);
+    values[i] = pressures[i];
+  }
+  status = applyAllPressure(values);
+  for (int i = 0; i < MAX_SIGNALS; i++)
+    if ((mask >> i) & 1) callParamCallbacks(i);
+  unlock();
+  return status;
+}
+
+/* Report parameters */ 
+void USBelveFlow::report(FILE *fp, int details){
+  fprintf(fp, " Port: %s \n", this->portName); 
+  if (details > 0) {
+    for (int i = 0; i < MAX_SIGNALS; i++)
+      fprintf(fp, "  Channel %d: pressure=%f mbar, flow=%f ul/min, volume=%f ul, dose state=%d\n",
+              i, _channels[i].pressure, _channels[i].flow, _channels[i].volume, _channels[i].doseState);
+    for (int i = 0; i < MAX_SIGNALS; i++)
+      fprintf(fp, "  Channel %d sensor: type=%d, kind=%d, calib=%d, resolution=%d%s\n",
+              i, _sensorApplied[i].type, _sensorApplied[i].kind, _sensorApplied[i].calib,
+              _sensorApplied[i].resolution,
+              memcmp(&_sensorConfig[i], &_sensorApplied[i], sizeof(sensorConfig_t)) ? " (pending)" : "");
+    for (int i = 0; i < MAX_SIGNALS; i++)
+      if (_correction[i].mode() != EFFlowCorrection::OFF)
+        fprintf(fp, "  Channel %d flow correction: mode=%d, %s\n",
+                i, _correction[i].mode(), _correction[i].valid() ? "in use" : "invalid, not applied");
+    fprintf(fp, "  Calibration: state=%d\n", _calibState);
+    if (_grouped) fprintf(fp, "  Acquisition: run by a group port\n");
+    fprintf(fp, "  I/O threads: priority %d, CPU mask 0x%lx\n",
+            _ioPriority ? _ioPriority : (int)epicsThreadPriorityHigh, _cpuMask);
+    fprintf(fp, "  Command queue: %d pending\n", _numCommands);
+    fprintf(fp, "  Sequencer: %d steps, state=%d, step=%d\n", _seqLength, _seqState, _seqStep);
+    fprintf(fp, "  Checkpoint: %s\n",
+            _checkpointReady ? "saved every cycle" : (_checkpoint.isOpen() ? "waiting for the IOC to run" : "none"));
+    fprintf(fp, "  Shared memory: %s, %llu samples\n",
+            _shm.isOpen() ? "open" : "not available", (unsigned long long)_shm.count());
+  }
+  asynPortDriver::report(fp, details); 
+}
+
+//_____________________________________________________________________________________________
+
+/** Callback function that is called by EPICS when the IOC exits */
 
 static void exitCallbackC(void *pPvt)
 {
   USBelveFlow *pUSBelveFlow = (USBelveFlow*) pPvt;
+  // The initialization thread still uses the driver while it waits for the
+  // OB1, it is left running rather than deleted under it
+  if (pUSBelveFlow->waitInit(1.0)) {
+    printf("USBelveFlow: port %s still initializing at exit, not shut down\n",
+           pUSBelveFlow->portName);
+    return;
+  }
   delete(pUSBelveFlow);
 }
 
+static void pollerThreadC(void *pPvt)
+{
+  USBelveFlow *pUSBelveFlow = (USBelveFlow*) pPvt;
+  pUSBelveFlow->pollerThread();
+}
+
+static void analysisThreadC(void *pPvt)
+{
+  USBelveFlow *pUSBelveFlow = (USBelveFlow*) pPvt;
+  pUSBelveFlow->analysisThread();
+}
+
+static void digitalThreadC(void *pPvt)
+{
+  USBelveFlow *pUSBelveFlow = (USBelveFlow*) pPvt;
+  pUSBelveFlow->digitalThread();
+}
+
+static void initThreadC(void *pPvt)
+{
+  USBelveFlow *pUSBelveFlow = (USBelveFlow*) pPvt;
+  pUSBelveFlow->initController();
+}
+
+static void calibThreadC(void *pPvt)
+{
+  USBelveFlow *pUSBelveFlow = (USBelveFlow*) pPvt;
+  pUSBelveFlow->calibThread();
+}
+
+//Drivers created by USBelveFlowConfig, for the init hook
+#define MAX_CONTROLLERS 16
+static USBelveFlow *controllers[MAX_CONTROLLERS];
+static int numControllers = 0;
+
+//Time iocInit waits for the initialization of all controllers, s
+extern "C" {
+double elveFlowInitTimeout = 30.0;
+epicsExportAddress(double, elveFlowInitTimeout);
+}
+
+static void elveFlowInitHook(initHookState state)
+{
+  if (state == initHookAtBeginning) {
+    // The controllers initialize in parallel, the IOC waits for the
+    // slowest one but not longer than elveFlowInitTimeout in total
+    epicsTimeStamp start, now;
+    epicsTimeGetCurrent(&start);
+    for (int i = 0; i < numControllers; i++) {
+      double remaining;
+      epicsTimeGetCurrent(&now);
+      remaining = elveFlowInitTimeout - epicsTimeDiffInSeconds(&now, &start);
+      if (controllers[i]->waitInit(remaining > 0 ? remaining : 0))
+        printf("USBelveFlow: port %s not initialized after %g s, it connects when done\n",
+               controllers[i]->portName, elveFlowInitTimeout);
+    }
+  }
+  else if (state == initHookAfterIocRunning) {
+    for (int i = 0; i < numControllers; i++) {
+      controllers[i]->connectSensors();
+      controllers[i]->resumeControl();
+    }
+  }
+}
+
 /** Configuration command, called directly or from iocsh */
-extern "C" int USBelveFlowConfig(const char *portName)
+extern "C" int USBelveFlowConfig(const char *portName, const char *checkpointFile,
+                                 int priority, int cpuMask)
+{
+  if (numControllers == MAX_CONTROLLERS) {
+    printf("USBelveFlowConfig: at most %d controllers\n", MAX_CONTROLLERS);
+    return(asynError);
+  }
+  // 0 selects the default priorities, so a configured one starts above the minimum
+  if (priority != 0 && (priority <= (int)epicsThreadPriorityMin || priority > (int)epicsThreadPriorityMax)) {
+    printf("USBelveFlowConfig: priority must be between %d and %d, or 0 for the default\n",
+           (int)epicsThreadPriorityMin + 1, (int)epicsThreadPriorityMax);
+    return(asynError);
+  }
+  // Set up once, after the arguments of the first controller are accepted
+  if (numControllers == 0) {
+    tickSkew.lock = epicsMutexMustCreate();
+    initHookRegister(elveFlowInitHook);
+  }
+  controllers[numControllers++] = new USBelveFlow(portName, checkpointFile, priority, cpuMask);
+  return(asynSuccess);
+}
+
+//_____________________________________________________________________________________________
+
+/** Group port over several OB1s: the channels of the members are addresses
+  * 0..4*members-1, in the order the members are listed. One thread runs the
+  * cycles of all members back to back with a common timestamp and publishes
+  * the samples as one array. Pressures written to the group are collected
+  * and sent with one OB1_Set_All_Press per member at the start of the next
+  * cycle. */
+class USBelveFlowGroup : public asynPortDriver {
+public:
+  USBelveFlowGroup(const char *portName, USBelveFlow **members, int numMembers, double period);
+  ~USBelveFlowGroup();
+  void groupThread();
+
+  /* These are the methods that we override from asynPortDriver */
+  virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+  virtual asynStatus writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements);
+  virtual void report(FILE *fp, int details);
+
+protected:
+  int setPressure_;
+  int readPressure_;
+  int readSensor_;
+  int pollPeriod_;
+  int groupTime_;
+  int groupPressure_;
+  int groupFlow_;
+  int groupSetpoint_;
+  int groupSetAll_;
+  int groupSpread_;
+  int groupCycleTime_;
+  int tickOffset_;
+  int tickSkew_;
+  int tickPorts_;
+
+private:
+  void queuePressure(int addr, double value);
+
+  USBelveFlow *_members[MAX_GROUP_MEMBERS];
+  int _numMembers;
+  int _numChannels;
+  int _pendingMask[MAX_GROUP_MEMBERS];              // channels written since the last cycle
+  double _pending[MAX_GROUP_MEMBERS][MAX_SIGNALS];
+  // Samples of the last cycle, only written by the group thread
+  double *_pressure;
+  double *_flow;
+  double *_setpoint;
+  int _exiting;
+  epicsEventId _groupEvent;
+  epicsEventId _groupDoneEvent;
+};
+
+USBelveFlowGroup::USBelveFlowGroup(const char *portName, USBelveFlow **members, int numMembers, double period)
+  : asynPortDriver(portName,
+                   numMembers * MAX_SIGNALS,
+                   asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask | asynDrvUserMask,
+                   asynInt32Mask | asynFloat64Mask | asynFloat64ArrayMask,
+                   ASYN_MULTIDEVICE | ASYN_CANBLOCK,
+                   1,
+                   0, 0)
+{
+  static const char *functionName = "USBelveFlowGroup";
+
+  _numMembers = numMembers;
+  _numChannels = numMembers * MAX_SIGNALS;
+  for (int m = 0; m < numMembers; m++) _members[m] = members[m];
+  memset(_pendingMask, 0, sizeof(_pendingMask));
+  _pressure = new double[_numChannels];
+  _flow = new double[_numChannels];
+  _setpoint = new double[_numChannels];
+  _exiting = 0;
+
+  createParam(EFSetPressureString,   asynParamFloat64,      &setPressure_);
+  createParam(EFReadPressureString,  asynParamFloat64,      &readPressure_);
+  createParam(EFReadFlowSting,       asynParamFloat64,      &readSensor_);
+  createParam(EFPollPeriodString,    asynParamFloat64,      &pollPeriod_);
+  createParam(EFGroupTimeString,     asynParamFloat64,      &groupTime_);
+  createParam(EFGroupPressureString, asynParamFloat64Array, &groupPressure_);
+  createParam(EFGroupFlowString,     asynParamFloat64Array, &groupFlow_);
+  createParam(EFGroupSetpointString, asynParamFloat64Array, &groupSetpoint_);
+  createParam(EFGroupSetAllString,   asynParamFloat64Array, &groupSetAll_);
+  createParam(EFGroupSpreadString,   asynParamFloat64,      &groupSpread_);
+  createParam(EFGroupCycleTimeString, asynParamFloat64,     &groupCycleTime_);
+  createParam(EFTickOffsetString,    asynParamFloat64,      &tickOffset_);
+  createParam(EFTickSkewString,      asynParamFloat64,      &tickSkew_);
+  createParam(EFTickPortsString,     asynParamInt32,        &tickPorts_);
+
+  setDoubleParam(pollPeriod_, period > 0 ? period : DEFAULT_POLL_PERIOD);
+  setDoubleParam(groupTime_, 0.0);
+  setDoubleParam(groupSpread_, 0.0);
+  setDoubleParam(groupCycleTime_, 0.0);
+  setDoubleParam(tickOffset_, 0.0);
+  setDoubleParam(tickSkew_, 0.0);
+  setIntegerParam(tickPorts_, 0);
+  for (int a = 0; a < _numChannels; a++) {
+    setDoubleParam(a, setPressure_, 0.0);
+    setDoubleParam(a, readPressure_, 0.0);
+    setDoubleParam(a, readSensor_, 0.0);
+    callParamCallbacks(a);
+  }
+
+  _groupEvent = epicsEventMustCreate(epicsEventEmpty);
+  _groupDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+  if (epicsThreadCreate("USBelveFlowGroup",
+                        epicsThreadPriorityHigh,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)groupThreadC,
+                        this) == NULL) {
+    printf("%s:%s: epicsThreadCreate failure\n", driverName, functionName);
+  }
+  // Registered after the members, so it stops before they are deleted
+  epicsAtExit(groupExitCallbackC, this);
+}
+
+USBelveFlowGroup::~USBelveFlowGroup()
+{
+  lock();
+  _exiting = 1;
+  unlock();
+  epicsEventSignal(_groupEvent);
+  epicsEventWaitWithTimeout(_groupDoneEvent, 1.0);
+  delete[] _pressure;
+  delete[] _flow;
+  delete[] _setpoint;
+}
+
+/** Keeps a pressure for the next cycle, a later write to the same channel
+  * replaces it. Must be called with the group locked. */
+void USBelveFlowGroup::queuePressure(int addr, double value){
+  int m = addr / MAX_SIGNALS, ch = addr % MAX_SIGNALS;
+
+  _pending[m][ch] = value;
+  _pendingMask[m] |= 1 << ch;
+  setDoubleParam(addr, setPressure_, value);
+}
+
+asynStatus USBelveFlowGroup::writeFloat64(asynUser *pasynUser, epicsFloat64 value){
+  int addr;
+  int function = pasynUser->reason;
+  static const char *functionName = "writeFloat64";
+
+  this->getAddress(pasynUser, &addr);
+
+  if (function == setPressure_) {
+    queuePressure(addr, value);
+  }
+  else if (function == pollPeriod_) {
+    setDoubleParam(function, value);
+    // Wake up the group thread so that the new period is used immediately
+    epicsEventSignal(_groupEvent);
+  }
+  else {
+    return asynPortDriver::writeFloat64(pasynUser, value);
+  }
+  callParamCallbacks(addr);
+  asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+           "%s:%s, port %s, wrote %f to address %d\n",
+           driverName, functionName, this->portName, value, addr);
+  return asynSuccess;
+}
+
+asynStatus USBelveFlowGroup::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements){
+  int function = pasynUser->reason;
+
+  if (function == groupSetAll_) {
+    // One pressure per group address, a shorter array sets the first ones
+    if (nElements > (size_t)_numChannels) nElements = _numChannels;
+    for (size_t a = 0; a < nElements; a++) {
+      queuePressure((int)a, value[a]);
+      callParamCallbacks((int)a);
+    }
+    doCallbacksFloat64Array(value, nElements, function, 0);
+    return asynSuccess;
+  }
+  return asynPortDriver::writeFloat64Array(pasynUser, value, nElements);
+}
+
+/** Group thread: sends the collected pressures, then runs the cycle of
+  * every member with the timestamp taken before the first one. The member
+  * locks are never taken with the group lock held. The cycles start on the
+  * same tick boundaries as the aligned USBelveFlow ports. */
+void USBelveFlowGroup::groupThread(){
+  epicsTimeStamp now, next, stamp, last;
+  double period, delay, skew;
+  int mask[MAX_GROUP_MEMBERS], status[MAX_GROUP_MEMBERS], ports, onTick = 0;
+  double values[MAX_GROUP_MEMBERS][MAX_SIGNALS];
+
+  epicsTimeGetCurrent(&next);
+  lock();
+  while (!_exiting) {
+    getDoubleParam(pollPeriod_, &period);
+    if (period < 0.001) period = 0.001;
+
+    epicsTimeGetCurrent(&now);
+    if (!epicsTimeLessThan(&now, &next)) {
+      memcpy(mask, _pendingMask, sizeof(mask));
+      memcpy(values, _pending, sizeof(values));
+      memset(_pendingMask, 0, sizeof(_pendingMask));
+      unlock();
+
+      for (int m = 0; m < _numMembers; m++)
+        if (mask[m]) status[m] = _members[m]->groupSetPressures(mask[m], values[m]);
+      epicsTimeGetCurrent(&stamp);
+      if (onTick) reportTick(&next, &stamp, &skew, &ports);
+      last = stamp;
+      for (int m = 0; m < _numMembers; m++) {
+        if (m > 0) epicsTimeGetCurrent(&last);
+        _members[m]->groupCycle(&stamp, period, &_pressure[m * MAX_SIGNALS],
+                                &_flow[m * MAX_SIGNALS], &_setpoint[m * MAX_SIGNALS]);
+      }
+      epicsTimeGetCurrent(&now);
+
+      lock();
+      for (int m = 0; m < _numMembers; m++) {
+        if (!mask[m] || status[m] == 0) continue;
+        if (status[m] > 0) {
+          // Sent once the controller is initialized, unless written again
+          for (int i = 0; i < MAX_SIGNALS; i++) {
+            if (!((mask[m] >> i) & 1) || ((_pendingMask[m] >> i) & 1)) continue;
+            _pending[m][i] = values[m][i];
+            _pendingMask[m] |= 1 << i;
+          }
+        }
+        else {
+          asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s::groupThread port %s, setting the pressures of %s failed\n",
+                    driverName, this->portName, _members[m]->portName);
+        }
+      }
+      setTimeStamp(&stamp);
+      for (int a = 0; a < _numChannels; a++) {
+        setDoubleParam(a, readPressure_, _pressure[a]);
+        setDoubleParam(a, readSensor_, _flow[a]);
+      }
+      setDoubleParam(groupTime_, stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + stamp.nsec * 1e-9);
+      // Time between the start of the first and of the last member read
+      setDoubleParam(groupSpread_, epicsTimeDiffInSeconds(&last, &stamp));
+      setDoubleParam(groupCycleTime_, epicsTimeDiffInSeconds(&now, &stamp));
+      if (onTick) {
+        setDoubleParam(tickOffset_, epicsTimeDiffInSeconds(&stamp, &next));
+        setDoubleParam(tickSkew_, skew);
+        setIntegerParam(tickPorts_, ports);
+      }
+      doCallbacksFloat64Array(_pressure, _numChannels, groupPressure_, 0);
+      doCallbacksFloat64Array(_flow, _numChannels, groupFlow_, 0);
+      doCallbacksFloat64Array(_setpoint, _numChannels, groupSetpoint_, 0);
+      for (int a = 0; a < _numChannels; a++) callParamCallbacks(a);
+
+      // A cycle that overran skips the ticks it missed
+      nextTick(&next, &now, period);
+      onTick = 1;
+    }
+    unlock();
+
+    epicsTimeGetCurrent(&now);
+    delay = epicsTimeDiffInSeconds(&next, &now);
+    if (delay > 0) epicsEventWaitWithTimeout(_groupEvent, delay);
+    lock();
+  }
+  unlock();
+  epicsEventSignal(_groupDoneEvent);
+}
+
+void USBelveFlowGroup::report(FILE *fp, int details){
+  fprintf(fp, " Group port: %s, %d controllers\n", this->portName, _numMembers);
+  if (details > 0) {
+    for (int m = 0; m < _numMembers; m++)
+      fprintf(fp, "  Addresses %d-%d: %s\n", m * MAX_SIGNALS, (m + 1) * MAX_SIGNALS - 1,
+              _members[m]->portName);
+  }
+  asynPortDriver::report(fp, details);
+}
+
+static void groupExitCallbackC(void *pPvt)
+{
+  USBelveFlowGroup *pGroup = (USBelveFlowGroup*) pPvt;
+  delete(pGroup);
+}
+
+static void groupThreadC(void *pPvt)
+{
+  USBelveFlowGroup *pGroup = (USBelveFlowGroup*) pPvt;
+  pGroup->groupThread();
+}
+
+/** Group configuration command. members lists the ports of controllers
+  * created by USBelveFlowConfig, separated by commas or spaces. */
+extern "C" int USBelveFlowGroupConfig(const char *portName, const char *members, double period)
 {
-  new USBelveFlow(portName);
+  USBelveFlow *list[MAX_GROUP_MEMBERS];
+  int numMembers = 0;
+  const char *p = members ? members : "";
+
+  while (*p) {
+    char name[64];
+    size_t len;
+    int i;
+
+    p += strspn(p, ", ");
+    len = strcspn(p, ", ");
+    if (len == 0) break;
+    if (len >= sizeof(name)) len = sizeof(name) - 1;
+    memcpy(name, p, len);
+    name[len] = '\0';
+    p += strcspn(p, ", ");
+
+    for (i = 0; i < numControllers; i++)
+      if (strcmp(controllers[i]->portName, name) == 0) break;
+    if (i == numControllers) {
+      printf("USBelveFlowGroupConfig: no USBelveFlow port %s\n", name);
+      return(asynError);
+    }
+    if (numMembers == MAX_GROUP_MEMBERS) {
+      printf("USBelveFlowGroupConfig: at most %d controllers\n", MAX_GROUP_MEMBERS);
+      return(asynError);
+    }
+    list[numMembers++] = controllers[i];
+  }
+  if (numMembers == 0) {
+    printf("USBelveFlowGroupConfig: no controllers given\n");
+    return(asynError);
+  }
+  for (int m = 0; m < numMembers; m++) {
+    for (int k = 0; k < m; k++) {
+      if (list[k] == list[m]) {
+        printf("USBelveFlowGroupConfig: port %s is listed twice\n", list[m]->portName);
+        return(asynError);
+      }
+    }
+  }
+  // If a member is already in a group the ones that joined before it are
+  // released, so that their pollers acquire again
+  for (int m = 0; m < numMembers; m++) {
+    if (list[m]->joinGroup()) {
+      printf("USBelveFlowGroupConfig: port %s is already in a group\n", list[m]->portName);
+      while (--m >= 0) list[m]->leaveGroup();
+      return(asynError);
+    }
+  }
+  new USBelveFlowGroup(portName, list, numMembers, period);
   return(asynSuccess);
 }
 
 
 static const iocshArg configArg0 = { "Port name",      iocshArgString};
-static const iocshArg * const configArgs[] = {&configArg0};
-static const iocshFuncDef configFuncDef = {"USBelveFlowConfig", 1, configArgs};
+static const iocshArg configArg1 = { "Checkpoint file", iocshArgString};
+static const iocshArg configArg2 = { "Thread priority", iocshArgInt};
+static const iocshArg configArg3 = { "CPU mask",        iocshArgInt};
+static const iocshArg * const configArgs[] = {&configArg0, &configArg1, &configArg2, &configArg3};
+static const iocshFuncDef configFuncDef = {"USBelveFlowConfig", 4, configArgs};
 static void configCallFunc(const iocshArgBuf *args)
 {
-  USBelveFlowConfig(args[0].sval);
+  USBelveFlowConfig(args[0].sval, args[1].sval, args[2].ival, args[3].ival);
+}
+
+static const iocshArg groupArg0 = { "Port name",      iocshArgString};
+static const iocshArg groupArg1 = { "Member ports",   iocshArgString};
+static const iocshArg groupArg2 = { "Poll period",    iocshArgDouble};
+static const iocshArg * const groupArgs[] = {&groupArg0, &groupArg1, &groupArg2};
+static const iocshFuncDef groupFuncDef = {"USBelveFlowGroupConfig", 3, groupArgs};
+static void groupCallFunc(const iocshArgBuf *args)
+{
+  USBelveFlowGroupConfig(args[0].sval, args[1].sval, args[2].dval);
+}
+
+static const iocshFuncDef initReportFuncDef = {"USBelveFlowInitReport", 0, NULL};
+static void initReportCallFunc(const iocshArgBuf *)
+{
+  double slowest = 0, sum = 0;
+
+  printf("%-16s %-8s %8s", "port", "state", "create");
+  for (int i = 0; i < NUM_INIT_PHASES; i++) printf(" %11s", initPhaseNames[i]);
+  printf(" %8s %8s\n", "total", "waited");
+  for (int i = 0; i < numControllers; i++) {
+    double serial = controllers[i]->initReport(stdout);
+    if (serial > slowest) slowest = serial;
+    sum += serial;
+  }
+  printf("%d controller(s), slowest %.3f s, serial sum %.3f s\n", numControllers, slowest, sum);
 }
 
 void drvUSBelveFlowRegister(void)
 {
   iocshRegister(&configFuncDef,configCallFunc);
+  iocshRegister(&initReportFuncDef,initReportCallFunc);
+  iocshRegister(&groupFuncDef,groupCallFunc);
 }
 
 extern "C" {
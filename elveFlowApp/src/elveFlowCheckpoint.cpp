@@ -0,0 +1,145 @@
+/* elveFlowCheckpoint.cpp
+ *
+ * Memory mapped checkpoint of the control state of one OB1.
+ *
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include "elveFlowCheckpoint.h"
+
+EFCheckpoint::EFCheckpoint() : _file(0), _generation(0)
+{
+#ifdef _WIN32
+  _handle = 0;
+  _mapping = 0;
+#endif
+}
+
+/** FNV-1a of a copy, without its checksum field */
+uint32_t EFCheckpoint::checksum(const efCheckpointState_t *state)
+{
+  const unsigned char *p = (const unsigned char *)state;
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < sizeof(*state); i++) {
+    if (i >= offsetof(efCheckpointState_t, checksum) &&
+        i < offsetof(efCheckpointState_t, checksum) + sizeof(state->checksum)) continue;
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+int EFCheckpoint::map(const char *fileName)
+{
+#ifdef _WIN32
+  _handle = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (_handle == INVALID_HANDLE_VALUE) { _handle = 0; return -1; }
+  // Grows the file to the mapping size if it is shorter
+  _mapping = CreateFileMappingA((HANDLE)_handle, NULL, PAGE_READWRITE, 0, sizeof(file_t), NULL);
+  if (!_mapping) return -1;
+  _file = (file_t *)MapViewOfFile((HANDLE)_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(file_t));
+#else
+  int fd = ::open(fileName, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  void *base;
+
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) != 0 || ((size_t)st.st_size < sizeof(file_t) && ftruncate(fd, sizeof(file_t)) != 0)) {
+    ::close(fd);
+    return -1;
+  }
+  base = mmap(0, sizeof(file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (base != MAP_FAILED) _file = (file_t *)base;
+#endif
+  return _file ? 0 : -1;
+}
+
+int EFCheckpoint::open(const char *fileName, const char *portName)
+{
+  close();
+  if (map(fileName)) {
+    close();
+    return -1;
+  }
+
+  if (_file->magic != EF_CHECKPOINT_MAGIC || _file->version != EF_CHECKPOINT_VERSION ||
+      _file->size != sizeof(file_t) || strncmp(_file->portName, portName, sizeof(_file->portName)) != 0) {
+    memset(_file, 0, sizeof(file_t));
+    _file->magic = EF_CHECKPOINT_MAGIC;
+    _file->version = EF_CHECKPOINT_VERSION;
+    _file->size = sizeof(file_t);
+    strncpy(_file->portName, portName, sizeof(_file->portName) - 1);
+  }
+  // The next save goes to the other copy than the valid one, even if the
+  // copy it overwrites has a higher generation
+  efCheckpointState_t state;
+  _generation = (restore(&state) == 0) ? state.generation : 0;
+  return 0;
+}
+
+void EFCheckpoint::close()
+{
+  if (!_file) {
+#ifdef _WIN32
+    if (_mapping) CloseHandle((HANDLE)_mapping);
+    if (_handle) CloseHandle((HANDLE)_handle);
+    _mapping = 0;
+    _handle = 0;
+#endif
+    return;
+  }
+#ifdef _WIN32
+  FlushViewOfFile(_file, sizeof(file_t));
+  UnmapViewOfFile(_file);
+  CloseHandle((HANDLE)_mapping);
+  CloseHandle((HANDLE)_handle);
+  _mapping = 0;
+  _handle = 0;
+#else
+  msync(_file, sizeof(file_t), MS_SYNC);
+  munmap(_file, sizeof(file_t));
+#endif
+  _file = 0;
+}
+
+int EFCheckpoint::restore(efCheckpointState_t *state) const
+{
+  const efCheckpointState_t *best = 0;
+
+  if (!_file) return -1;
+  for (int i = 0; i < 2; i++) {
+    const efCheckpointState_t *pc = &_file->copy[i];
+    if (pc->generation == 0 || pc->checksum != checksum(pc)) continue;
+    if (!best || pc->generation > best->generation) best = pc;
+  }
+  if (!best) return -1;
+  *state = *best;
+  return 0;
+}
+
+void EFCheckpoint::save(const efCheckpointState_t *state)
+{
+  efCheckpointState_t *pc;
+
+  if (!_file) return;
+  _generation++;
+  pc = &_file->copy[_generation & 1];
+  *pc = *state;
+  pc->generation = _generation;
+  pc->checksum = checksum(pc);
+}
@@ -0,0 +1,86 @@
+/* elveFlowCheckpoint.h
+ *
+ * Control state of the driver kept in a small memory mapped file, so that
+ * an IOC restart resumes regulators, ramps and totalizers where they were.
+ *
+ * The file holds two copies of the state, each with a generation counter
+ * and a checksum. save() overwrites the older copy, so a copy that was
+ * being written when the IOC stopped is recognized by its checksum and the
+ * other one is used. Writing is a memory copy, the operating system puts the
+ * pages on disk.
+ *
+ */
+
+#ifndef ELVEFLOWCHECKPOINT_H
+#define ELVEFLOWCHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EF_CHECKPOINT_MAGIC 0x45464350  /* "EFCP" */
+#define EF_CHECKPOINT_VERSION 1
+#define EF_CHECKPOINT_CHANNELS 4
+
+/** Control state of one channel */
+typedef struct {
+  double setpoint;          // pressure setpoint, mbar
+  double flowSetpoint;      // regulator setpoint, ul/min
+  int32_t regEnabled;
+  int32_t rampActive;
+  double regIntegral;       // mbar
+  double regOutput;         // mbar
+  double rampStart;         // mbar
+  double rampTarget;        // mbar
+  double rampVelocity;      // mbar/s
+  double volume;            // ul
+  double doseStartVolume;   // ul
+} efCheckpointChannel_t;
+
+/** One copy of the state */
+typedef struct {
+  uint32_t generation;      // incremented by every save
+  uint32_t checksum;        // of the rest of the copy
+  double time;              // seconds past the POSIX epoch
+  efCheckpointChannel_t channel[EF_CHECKPOINT_CHANNELS];
+} efCheckpointState_t;
+
+class EFCheckpoint {
+public:
+  EFCheckpoint();
+  ~EFCheckpoint() { close(); }
+
+  /** Maps the file, creating it if needed. A file written for another port
+    * or by another version is started again. Returns 0 on success. */
+  int open(const char *fileName, const char *portName);
+  void close();
+  bool isOpen() const { return _file != 0; }
+
+  /** Copies the newest valid state. Returns 0 on success, -1 if the file
+    * holds none. */
+  int restore(efCheckpointState_t *state) const;
+
+  /** Stores the state in place of the older copy */
+  void save(const efCheckpointState_t *state);
+
+private:
+  typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t reserved;
+    char portName[32];
+    efCheckpointState_t copy[2];
+  } file_t;
+
+  static uint32_t checksum(const efCheckpointState_t *state);
+  int map(const char *fileName);
+
+  file_t *_file;
+  uint32_t _generation;
+#ifdef _WIN32
+  void *_handle;
+  void *_mapping;
+#endif
+};
+
+#endif /* ELVEFLOWCHECKPOINT_H */
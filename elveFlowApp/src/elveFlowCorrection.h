@@ -0,0 +1,119 @@
+/* elveFlowCorrection.h
+ *
+ * User correction curve of a flow sensor, applied to every acquired sample
+ * on top of the H2O/IPA calibration of the sensor itself.
+ *
+ * The curve is either a piecewise linear table (x raw flow, y corrected
+ * flow, x strictly increasing, the end segments are extended) or a
+ * polynomial in the raw flow. Both are turned into one form when they are
+ * loaded,
+ *
+ *     y = c0 + c1 x + ... + c5 x^5 + sum_k d_k max(x - x_k, 0)
+ *
+ * a table giving c0, c1 from its first segment and one hinge per interior
+ * point. apply() always evaluates every term, unused ones are zero, so it
+ * has neither branches nor a table search and its cost does not depend on
+ * the curve.
+ *
+ */
+
+#ifndef ELVEFLOWCORRECTION_H
+#define ELVEFLOWCORRECTION_H
+
+#include <math.h>
+#include <string.h>
+
+class EFFlowCorrection {
+public:
+  enum { OFF = 0, TABLE = 1, POLYNOMIAL = 2 };
+  enum { MAX_POINTS = 32, MAX_COEFS = 6 };
+
+  EFFlowCorrection() : _mode(OFF), _numX(0), _numY(0), _numCoefs(0) { build(); }
+
+  /** The set functions keep the user data and rebuild the curve. They return
+    * 0 if the curve is in use, -1 if it is invalid for the current mode and
+    * the raw flow is passed through. */
+  int setMode(int mode) { _mode = mode; return build(); }
+
+  int setX(const double *x, int n) { _numX = copy(_x, x, n, MAX_POINTS); return build(); }
+  int setY(const double *y, int n) { _numY = copy(_y, y, n, MAX_POINTS); return build(); }
+
+  /** Coefficients of the polynomial, constant term first */
+  int setCoefs(const double *c, int n) { _numCoefs = copy(_coefs, c, n, MAX_COEFS); return build(); }
+
+  int mode() const { return _mode; }
+  bool valid() const { return _valid; }
+  const double *x() const { return _x; }
+  const double *y() const { return _y; }
+  const double *coefs() const { return _coefs; }
+  int numX() const { return _numX; }
+  int numY() const { return _numY; }
+  int numCoefs() const { return _numCoefs; }
+
+  double apply(double raw) const {
+    double y = _c[MAX_COEFS - 1];
+    for (int k = MAX_COEFS - 2; k >= 0; k--) y = y * raw + _c[k];
+    for (int k = 0; k < MAX_POINTS; k++) y += _kink[k] * fmax(raw - _knot[k], 0.0);
+    return y;
+  }
+
+private:
+  static int copy(double *to, const double *from, int n, int max) {
+    if (n < 0) n = 0;
+    if (n > max) n = max;
+    memcpy(to, from, n * sizeof(double));
+    return n;
+  }
+
+  int build() {
+    memset(_c, 0, sizeof(_c));
+    memset(_knot, 0, sizeof(_knot));
+    memset(_kink, 0, sizeof(_kink));
+    _valid = true;
+
+    if (_mode == TABLE && _numX >= 2 && _numX == _numY) {
+      double slope = 0, previous = 0;
+      for (int k = 0; k < _numX - 1; k++) {
+        if (!(_x[k+1] > _x[k])) _valid = false;
+      }
+      for (int k = 0; _valid && k < _numX - 1; k++) {
+        slope = (_y[k+1] - _y[k]) / (_x[k+1] - _x[k]);
+        if (k == 0) {
+          _c[0] = _y[0] - slope * _x[0];
+          _c[1] = slope;
+        }
+        else {
+          _knot[k] = _x[k];
+          _kink[k] = slope - previous;
+        }
+        previous = slope;
+      }
+    }
+    else if (_mode == POLYNOMIAL && _numCoefs > 0) {
+      memcpy(_c, _coefs, _numCoefs * sizeof(double));
+    }
+    else if (_mode != OFF) _valid = false;
+
+    if (!_valid) {
+      memset(_c, 0, sizeof(_c));
+      memset(_kink, 0, sizeof(_kink));
+    }
+    // Identity when the correction is off or unusable
+    if (_mode == OFF || !_valid) _c[1] = 1.0;
+    return _valid ? 0 : -1;
+  }
+
+  int _mode;
+  bool _valid;
+  double _x[MAX_POINTS];
+  double _y[MAX_POINTS];
+  double _coefs[MAX_COEFS];
+  int _numX;
+  int _numY;
+  int _numCoefs;
+  double _c[MAX_COEFS];
+  double _knot[MAX_POINTS];
+  double _kink[MAX_POINTS];
+};
+
+#endif /* ELVEFLOWCORRECTION_H */
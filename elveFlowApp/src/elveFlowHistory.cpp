@@ -0,0 +1,160 @@
+/* elveFlowHistory.cpp
+ *
+ * Multi-resolution history of pressure and flow of one channel.
+ * Samples go into the raw ring and into the open second and minute buckets,
+ * a bucket is moved into its ring when the first sample of the next one
+ * arrives. Queries merge the elements of one tier into the requested number
+ * of intervals.
+ *
+ */
+
+#include <math.h>
+
+#include "elveFlowHistory.h"
+
+void EFHistory::clear()
+{
+  _rawHead = 0;
+  _rawCount = 0;
+
+  _seconds.buckets = _secondBuckets;
+  _seconds.length = SECOND_LENGTH;
+  _seconds.head = 0;
+  _seconds.count = 0;
+  _seconds.width = 1.0;
+  _seconds.current.count = 0;
+
+  _minutes.buckets = _minuteBuckets;
+  _minutes.length = MINUTE_LENGTH;
+  _minutes.head = 0;
+  _minutes.count = 0;
+  _minutes.width = 60.0;
+  _minutes.current.count = 0;
+
+  _newest = 0.0;
+}
+
+void EFHistory::pushBucket(tier_t *tier, const efHistBucket_t *bucket)
+{
+  tier->buckets[tier->head] = *bucket;
+  tier->head = (tier->head + 1) % tier->length;
+  if (tier->count < tier->length) tier->count++;
+}
+
+void EFHistory::mergeBucket(efHistBucket_t *into, const efHistBucket_t *from)
+{
+  for (int s = 0; s < EF_HIST_SIGNALS; s++) {
+    if (into->count == 0 || from->min[s] < into->min[s]) into->min[s] = from->min[s];
+    if (into->count == 0 || from->max[s] > into->max[s]) into->max[s] = from->max[s];
+    into->sum[s] = (into->count == 0) ? from->sum[s] : into->sum[s] + from->sum[s];
+  }
+  into->count += from->count;
+}
+
+/** Start time of the oldest element of a tier, the open bucket if the ring
+  * is still empty */
+double EFHistory::tierOldest(const tier_t *tier)
+{
+  if (tier->count == 0) return tier->current.time;
+  return tier->buckets[(tier->head - tier->count + tier->length) % tier->length].time;
+}
+
+void EFHistory::add(double time, const double *values)
+{
+  tier_t *tiers[2] = {&_seconds, &_minutes};
+  efHistBucket_t sample;
+
+  _raw[_rawHead].time = time;
+  for (int s = 0; s < EF_HIST_SIGNALS; s++) {
+    _raw[_rawHead].value[s] = values[s];
+    sample.min[s] = sample.max[s] = sample.sum[s] = values[s];
+  }
+  _rawHead = (_rawHead + 1) % RAW_LENGTH;
+  if (_rawCount < RAW_LENGTH) _rawCount++;
+  sample.count = 1;
+
+  for (int i = 0; i < 2; i++) {
+    tier_t *tier = tiers[i];
+    double start = floor(time / tier->width) * tier->width;
+
+    if (tier->current.count > 0 && start != tier->current.time) {
+      pushBucket(tier, &tier->current);
+      tier->current.count = 0;
+    }
+    if (tier->current.count == 0) tier->current.time = start;
+    mergeBucket(&tier->current, &sample);
+  }
+  _newest = time;
+}
+
+int EFHistory::query(double span, int maxPoints, efHistQuery_t *out) const
+{
+  double end = _newest, start, width;
+  const tier_t *tier = 0;
+  int rawCovers, secondsCover, n = 0;
+
+  if (_rawCount == 0 || maxPoints < 1 || span <= 0) return 0;
+  start = end - span;
+  width = span / maxPoints;
+
+  // The finest tier is used when the intervals are shorter than its buckets
+  // or when the coarser tier does not cover the span either
+  rawCovers = (_rawCount < RAW_LENGTH) ||
+              (_raw[(_rawHead - _rawCount + RAW_LENGTH) % RAW_LENGTH].time <= start);
+  secondsCover = (_seconds.count < _seconds.length) || (tierOldest(&_seconds) <= start);
+  if (rawCovers && (width < _seconds.width || !secondsCover)) tier = 0;
+  else if (secondsCover && width < _minutes.width) tier = &_seconds;
+  else tier = &_minutes;
+
+  // out->time holds the sample count of each interval until the end
+  for (int b = 0; b < maxPoints; b++) out->time[b] = 0;
+
+  if (!tier) {
+    for (int i = 0; i < _rawCount; i++) {
+      const rawSample_t *ps = &_raw[(_rawHead - _rawCount + i + RAW_LENGTH) % RAW_LENGTH];
+      int b;
+
+      if (ps->time < start) continue;
+      b = (int)((ps->time - start) / width);
+      if (b >= maxPoints) b = maxPoints - 1;
+      for (int s = 0; s < EF_HIST_SIGNALS; s++) {
+        if (out->time[b] == 0 || ps->value[s] < out->min[s][b]) out->min[s][b] = ps->value[s];
+        if (out->time[b] == 0 || ps->value[s] > out->max[s][b]) out->max[s][b] = ps->value[s];
+        out->mean[s][b] = (out->time[b] == 0) ? ps->value[s] : out->mean[s][b] + ps->value[s];
+      }
+      out->time[b] += 1;
+    }
+  }
+  else {
+    for (int i = 0; i <= tier->count; i++) {
+      // The open bucket comes last
+      const efHistBucket_t *pb = (i < tier->count) ?
+        &tier->buckets[(tier->head - tier->count + i + tier->length) % tier->length] : &tier->current;
+      int b;
+
+      if (pb->count == 0 || pb->time + tier->width <= start) continue;
+      b = (pb->time <= start) ? 0 : (int)((pb->time - start) / width);
+      if (b >= maxPoints) b = maxPoints - 1;
+      for (int s = 0; s < EF_HIST_SIGNALS; s++) {
+        if (out->time[b] == 0 || pb->min[s] < out->min[s][b]) out->min[s][b] = pb->min[s];
+        if (out->time[b] == 0 || pb->max[s] > out->max[s][b]) out->max[s][b] = pb->max[s];
+        out->mean[s][b] = (out->time[b] == 0) ? pb->sum[s] : out->mean[s][b] + pb->sum[s];
+      }
+      out->time[b] += pb->count;
+    }
+  }
+
+  // Drop the empty intervals, time becomes the interval centre
+  for (int b = 0; b < maxPoints; b++) {
+    double count = out->time[b];
+    if (count == 0) continue;
+    for (int s = 0; s < EF_HIST_SIGNALS; s++) {
+      out->min[s][n] = out->min[s][b];
+      out->max[s][n] = out->max[s][b];
+      out->mean[s][n] = out->mean[s][b] / count;
+    }
+    out->time[n] = start + (b + 0.5) * width - end;
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,85 @@
+/* elveFlowHistory.h
+ *
+ * Multi-resolution history of pressure and flow of one channel, so trend
+ * displays can be filled without the archiver.
+ *
+ *   raw      every sample, RAW_LENGTH samples (over a minute at 100 Hz)
+ *   seconds  min/max/mean per second over the last hour
+ *   minutes  min/max/mean per minute over the last day
+ *
+ * All storage is part of the object, nothing is allocated after creation.
+ *
+ */
+
+#ifndef ELVEFLOWHISTORY_H
+#define ELVEFLOWHISTORY_H
+
+//Signals kept in the history, same order as the driver statistics
+#define EF_HIST_SIGNALS 2
+
+typedef struct {
+  double time;                      // start of the bucket, s
+  int count;                        // samples merged in the bucket
+  double min[EF_HIST_SIGNALS];
+  double max[EF_HIST_SIGNALS];
+  double sum[EF_HIST_SIGNALS];
+} efHistBucket_t;
+
+/** Result of a query, arrays of at least maxPoints elements. time is
+  * relative to the newest sample (<= 0), mean/min/max are indexed by
+  * signal, 0 is pressure and 1 is flow. */
+typedef struct {
+  double *time;
+  double *min[EF_HIST_SIGNALS];
+  double *mean[EF_HIST_SIGNALS];
+  double *max[EF_HIST_SIGNALS];
+} efHistQuery_t;
+
+class EFHistory {
+public:
+  enum { RAW_LENGTH = 8192, SECOND_LENGTH = 3600, MINUTE_LENGTH = 1440 };
+
+  EFHistory() { clear(); }
+
+  void clear();
+
+  /** Adds one sample, time in seconds, must not go backwards */
+  void add(double time, const double *values);
+
+  /** Fills out with at most maxPoints min/mean/max points covering the last
+    * span seconds, using the finest tier that still holds the whole span.
+    * Empty intervals are skipped. Returns the number of points. */
+  int query(double span, int maxPoints, efHistQuery_t *out) const;
+
+  double newest() const { return _newest; }
+
+private:
+  typedef struct {
+    double time;
+    double value[EF_HIST_SIGNALS];
+  } rawSample_t;
+
+  typedef struct {
+    efHistBucket_t *buckets;
+    int length;
+    int head;                       // next slot to write
+    int count;
+    double width;                   // bucket width, s
+    efHistBucket_t current;         // bucket being filled
+  } tier_t;
+
+  static void pushBucket(tier_t *tier, const efHistBucket_t *bucket);
+  static void mergeBucket(efHistBucket_t *into, const efHistBucket_t *from);
+  static double tierOldest(const tier_t *tier);
+
+  rawSample_t _raw[RAW_LENGTH];
+  int _rawHead;
+  int _rawCount;
+  efHistBucket_t _secondBuckets[SECOND_LENGTH];
+  efHistBucket_t _minuteBuckets[MINUTE_LENGTH];
+  tier_t _seconds;
+  tier_t _minutes;
+  double _newest;
+};
+
+#endif /* ELVEFLOWHISTORY_H */
@@ -0,0 +1,329 @@
+/* elveFlowShm.h
+ *
+ * Shared memory export of the acquired samples, for analysis processes
+ * running on the IOC host.
+ *
+ * The driver writes every sample into a ring of slots that follows a
+ * versioned header. Each slot is protected by a sequence lock: the writer
+ * makes the sequence odd while it updates the slot, a reader copies the slot
+ * and retries if the sequence was odd or changed. Readers never block the
+ * writer and need no access rights beyond reading the mapping.
+ *
+ * This header has no EPICS dependency, a reader only needs to include it:
+ *
+ *     EFShmReader reader;
+ *     efShmSample_t s;
+ *     if (reader.open("elveFlowOB1") == 0 && reader.readLatest(&s) == 0)
+ *         printf("%f %f\n", s.time, s.flow[0]);
+ *
+ */
+
+#ifndef ELVEFLOWSHM_H
+#define ELVEFLOWSHM_H
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#define EF_SHM_FENCE() MemoryBarrier()
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define EF_SHM_FENCE() __sync_synchronize()
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#define EF_SHM_MAGIC 0x45464c57     /* "EFLW" */
+#define EF_SHM_VERSION 1
+#define EF_SHM_CHANNELS 4
+
+/** Start of the mapping. Readers check magic, version and the sizes before
+  * using it, the slots follow at headerSize bytes. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t slotSize;
+  uint32_t numSlots;
+  uint32_t numChannels;
+  volatile uint64_t count;    // samples written so far, the last one is count-1,
+                              // accessed with efShmStoreCount/efShmLoadCount
+  double period;              // acquisition period, s
+  char portName[32];
+} efShmHeader_t;
+
+/** One acquired sample */
+typedef struct {
+  uint64_t index;             // sample number, slot is index % numSlots
+  double time;                // seconds past the POSIX epoch
+  double pressure[EF_SHM_CHANNELS]; // mbar
+  double flow[EF_SHM_CHANNELS];     // ul/min
+  double setpoint[EF_SHM_CHANNELS]; // pressure setpoint, mbar
+} efShmSample_t;
+
+typedef struct {
+  volatile uint32_t seq;      // odd while the writer updates the slot
+  uint32_t reserved;
+  efShmSample_t sample;
+} efShmSlot_t;
+
+/** Stores the sample count with one atomic 64-bit store, a plain store is
+  * split in two on 32-bit targets. */
+inline void efShmStoreCount(volatile uint64_t *count, uint64_t value){
+#ifdef _WIN32
+  InterlockedExchange64((volatile LONG64 *)count, (LONG64)value);
+#else
+  __atomic_store_n(count, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/** Loads the sample count. Readers map the object read-only, so on 32-bit
+  * targets, where an atomic 64-bit load is a locked write, the two halves
+  * are read and the read is retried if the high half changed in between.
+  * The count only grows, so the low half then belongs to the same value. */
+inline uint64_t efShmLoadCount(const volatile uint64_t *count){
+#if defined(_WIN64) || defined(__LP64__)
+  uint64_t value = *count;
+  EF_SHM_FENCE();
+  return value;
+#else
+  const volatile uint32_t *half = (const volatile uint32_t *)count;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  const int lo = 1, hi = 0;
+#else
+  const int lo = 0, hi = 1;
+#endif
+  uint32_t high, low;
+
+  do {
+    high = half[hi];
+    EF_SHM_FENCE();
+    low = half[lo];
+    EF_SHM_FENCE();
+  } while (half[hi] != high);
+  return ((uint64_t)high << 32) | low;
+#endif
+}
+
+/** Name of the shared memory object of an asyn port */
+inline void efShmName(char *name, size_t size, const char *portName){
+#ifdef _WIN32
+  _snprintf(name, size, "Local\\elveFlow_%s", portName);
+  name[size - 1] = '\0';
+#else
+  snprintf(name, size, "/elveFlow_%s", portName);
+#endif
+}
+
+/** Mapping of a shared memory object, common to the writer and the reader */
+class EFShmMapping {
+public:
+  EFShmMapping() : _base(0), _size(0) {
+#ifdef _WIN32
+    _handle = 0;
+#endif
+  }
+  ~EFShmMapping() { unmap(); }
+
+  /** Creates (writer) or opens read-only (reader) the object. size is only
+    * used when creating, the reader maps the whole object. */
+  int map(const char *name, size_t size, bool create) {
+    unmap();
+#ifdef _WIN32
+    if (create)
+      _handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                   (DWORD)((uint64_t)size >> 32), (DWORD)size, name);
+    else
+      _handle = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (!_handle) return -1;
+    _base = MapViewOfFile(_handle, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, 0);
+    if (!_base) { unmap(); return -1; }
+    MEMORY_BASIC_INFORMATION info;
+    VirtualQuery(_base, &info, sizeof(info));
+    _size = info.RegionSize;
+#else
+    int fd = create ? shm_open(name, O_CREAT | O_RDWR, 0644) : shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (create && ftruncate(fd, size) != 0) { ::close(fd); return -1; }
+    if (fstat(fd, &st) != 0) { ::close(fd); return -1; }
+    _size = st.st_size;
+    _base = mmap(0, _size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (_base == MAP_FAILED) { _base = 0; return -1; }
+#endif
+    return 0;
+  }
+
+  void unmap() {
+#ifdef _WIN32
+    if (_base) UnmapViewOfFile(_base);
+    if (_handle) CloseHandle(_handle);
+    _handle = 0;
+#else
+    if (_base) munmap(_base, _size);
+#endif
+    _base = 0;
+    _size = 0;
+  }
+
+  void *base() const { return _base; }
+  size_t size() const { return _size; }
+
+private:
+  void *_base;
+  size_t _size;
+#ifdef _WIN32
+  HANDLE _handle;
+#endif
+};
+
+/** Writer side, used by the driver. There must be a single writer. */
+class EFShmWriter {
+public:
+  EFShmWriter() : _header(0), _slots(0) {}
+
+  int open(const char *portName, uint32_t numSlots, double period) {
+    char name[64];
+    size_t size = sizeof(efShmHeader_t) + (size_t)numSlots * sizeof(efShmSlot_t);
+
+    efShmName(name, sizeof(name), portName);
+    if (_map.map(name, size, true)) return -1;
+    _header = (efShmHeader_t *)_map.base();
+    _slots = (efShmSlot_t *)((char *)_map.base() + sizeof(efShmHeader_t));
+
+    // A previous run may have left data, invalidate it before the header
+    _header->magic = 0;
+    EF_SHM_FENCE();
+    memset(_map.base(), 0, size);
+    _header->version = EF_SHM_VERSION;
+    _header->headerSize = sizeof(efShmHeader_t);
+    _header->slotSize = sizeof(efShmSlot_t);
+    _header->numSlots = numSlots;
+    _header->numChannels = EF_SHM_CHANNELS;
+    _header->period = period;
+    strncpy(_header->portName, portName, sizeof(_header->portName) - 1);
+    EF_SHM_FENCE();
+    _header->magic = EF_SHM_MAGIC;
+    return 0;
+  }
+
+  void close() {
+    _map.unmap();
+    _header = 0;
+    _slots = 0;
+  }
+
+  bool isOpen() const { return _header != 0; }
+
+  /** Publishes one sample, the index field is filled in */
+  void write(const efShmSample_t *sample) {
+    uint64_t index;
+    efShmSlot_t *slot;
+    uint32_t seq;
+
+    if (!_header) return;
+    // Only this writer changes the count, its own read cannot be torn
+    index = _header->count;
+    slot = &_slots[index % _header->numSlots];
+    seq = slot->seq;
+    slot->seq = seq + 1;
+    EF_SHM_FENCE();
+    slot->sample = *sample;
+    slot->sample.index = index;
+    EF_SHM_FENCE();
+    slot->seq = seq + 2;
+    EF_SHM_FENCE();
+    efShmStoreCount(&_header->count, index + 1);
+  }
+
+  void setPeriod(double period) { if (_header) _header->period = period; }
+  uint64_t count() const { return _header ? _header->count : 0; }
+
+private:
+  EFShmMapping _map;
+  efShmHeader_t *_header;
+  efShmSlot_t *_slots;
+};
+
+/** Reader side, for analysis processes */
+class EFShmReader {
+public:
+  enum { OK = 0, NOT_YET = 1, OVERWRITTEN = -1, BUSY = -2 };
+
+  EFShmReader() : _header(0), _slots(0) {}
+
+  /** Opens the export of an asyn port. Returns -1 if it does not exist or
+    * was written by an incompatible driver version. */
+  int open(const char *portName) {
+    char name[64];
+    efShmHeader_t *header;
+
+    efShmName(name, sizeof(name), portName);
+    if (_map.map(name, 0, false)) return -1;
+    header = (efShmHeader_t *)_map.base();
+    if (_map.size() < sizeof(efShmHeader_t) ||
+        header->magic != EF_SHM_MAGIC || header->version != EF_SHM_VERSION ||
+        header->headerSize != sizeof(efShmHeader_t) || header->slotSize != sizeof(efShmSlot_t) ||
+        _map.size() < header->headerSize + (size_t)header->numSlots * header->slotSize) {
+      close();
+      return -1;
+    }
+    EF_SHM_FENCE();
+    _header = header;
+    _slots = (const efShmSlot_t *)((const char *)header + header->headerSize);
+    return 0;
+  }
+
+  void close() {
+    _map.unmap();
+    _header = 0;
+    _slots = 0;
+  }
+
+  const efShmHeader_t *header() const { return _header; }
+
+  /** Number of samples written, the newest is count()-1 and the oldest that
+    * can still be read is count()-numSlots */
+  uint64_t count() const { return _header ? efShmLoadCount(&_header->count) : 0; }
+
+  /** Copies sample index. Returns OK, NOT_YET if it has not been written,
+    * OVERWRITTEN if the ring has moved past it, BUSY if the writer kept the
+    * slot busy for all retries. */
+  int read(uint64_t index, efShmSample_t *sample) const {
+    const efShmSlot_t *slot;
+
+    if (!_header) return NOT_YET;
+    slot = &_slots[index % _header->numSlots];
+    for (int retry = 0; retry < 100; retry++) {
+      uint32_t seq = slot->seq;
+      EF_SHM_FENCE();
+      if (seq & 1) continue;
+      *sample = *(const efShmSample_t *)&slot->sample;
+      EF_SHM_FENCE();
+      if (slot->seq != seq) continue;
+      if (sample->index == index) return OK;
+      return (sample->index < index) ? NOT_YET : OVERWRITTEN;
+    }
+    return BUSY;
+  }
+
+  int readLatest(efShmSample_t *sample) const {
+    uint64_t n = count();
+    if (n == 0) return NOT_YET;
+    return read(n - 1, sample);
+  }
+
+private:
+  EFShmMapping _map;
+  const efShmHeader_t *_header;
+  const efShmSlot_t *_slots;
+};
+
+#endif /* ELVEFLOWSHM_H */
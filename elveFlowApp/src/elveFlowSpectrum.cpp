@@ -0,0 +1,109 @@
+/* elveFlowSpectrum.cpp
+ *
+ * Power spectral density estimation for the elveFlow analysis thread.
+ * Plain radix-2 FFT, the segments are short (at most a few thousand
+ * samples) and the analysis runs at low priority, so no FFT library is
+ * needed.
+ *
+ */
+
+#include <math.h>
+
+#include "elveFlowSpectrum.h"
+
+static const double twoPi = 6.283185307179586;
+
+void efFFT(double *re, double *im, int n)
+{
+  int i, j, k, len;
+
+  // Bit reversal permutation
+  for (i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      double t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+  // Butterflies
+  for (len = 2; len <= n; len <<= 1) {
+    double ang = -twoPi / len;
+    double wRe = cos(ang), wIm = sin(ang);
+    for (i = 0; i < n; i += len) {
+      double uRe = 1.0, uIm = 0.0;
+      for (k = 0; k < len/2; k++) {
+        int a = i + k, b = i + k + len/2;
+        double tRe = re[b]*uRe - im[b]*uIm;
+        double tIm = re[b]*uIm + im[b]*uRe;
+        re[b] = re[a] - tRe;
+        im[b] = im[a] - tIm;
+        re[a] += tRe;
+        im[a] += tIm;
+        double nRe = uRe*wRe - uIm*wIm;
+        uIm = uRe*wIm + uIm*wRe;
+        uRe = nRe;
+      }
+    }
+  }
+}
+
+int efWelchPSD(const double *x, int n, int nfft, double fs, double *psd, double *work)
+{
+  double *re = work, *im = work + nfft;
+  int nbins = nfft/2 + 1;
+  int step = nfft/2;
+  int nseg = 0;
+  double wss = 0.0;     // sum of the squared window
+  int i, start;
+
+  for (i = 0; i < nbins; i++) psd[i] = 0.0;
+  if (n < nfft || nfft < 4 || fs <= 0) return 0;
+
+  for (i = 0; i < nfft; i++) {
+    double w = 0.5 - 0.5*cos(twoPi*i/nfft);
+    wss += w*w;
+  }
+
+  // Segments are aligned on the most recent sample
+  for (start = n - nfft; start >= 0; start -= step) {
+    double mean = 0.0;
+    for (i = 0; i < nfft; i++) mean += x[start+i];
+    mean /= nfft;
+    for (i = 0; i < nfft; i++) {
+      double w = 0.5 - 0.5*cos(twoPi*i/nfft);
+      re[i] = (x[start+i] - mean) * w;
+      im[i] = 0.0;
+    }
+    efFFT(re, im, nfft);
+    for (i = 0; i < nbins; i++) psd[i] += re[i]*re[i] + im[i]*im[i];
+    nseg++;
+  }
+
+  // One-sided density: double everything except DC and Nyquist
+  for (i = 0; i < nbins; i++) {
+    psd[i] /= (nseg * fs * wss);
+    if (i != 0 && i != nbins-1) psd[i] *= 2.0;
+  }
+  return nseg;
+}
+
+double efPeakFrequency(const double *psd, int nfft, double fs)
+{
+  int nbins = nfft/2 + 1;
+  int peak = 1;
+
+  for (int i = 2; i < nbins; i++)
+    if (psd[i] > psd[peak]) peak = i;
+  return peak * fs / nfft;
+}
+
+double efRmsFromPSD(const double *psd, int nfft, double fs)
+{
+  int nbins = nfft/2 + 1;
+  double sum = 0.0;
+
+  for (int i = 1; i < nbins; i++) sum += psd[i];
+  return sqrt(sum * fs / nfft);
+}
@@ -0,0 +1,28 @@
+/* elveFlowSpectrum.h
+ *
+ * Power spectral density estimation for the elveFlow analysis thread.
+ *
+ */
+
+#ifndef ELVEFLOWSPECTRUM_H
+#define ELVEFLOWSPECTRUM_H
+
+/** In place radix-2 complex FFT, n must be a power of 2 */
+void efFFT(double *re, double *im, int n);
+
+/** Welch estimate of the one-sided power spectral density of x.
+  * x          n samples taken at fs Hz
+  * nfft       segment length, power of 2, segments overlap by 50% and are
+  *            Hann windowed after removing their mean
+  * psd        nfft/2+1 output bins in unit^2/Hz, bin k is at k*fs/nfft
+  * work       scratch space of 2*nfft doubles
+  * Returns the number of averaged segments, 0 if n < nfft */
+int efWelchPSD(const double *x, int n, int nfft, double fs, double *psd, double *work);
+
+/** Frequency of the largest PSD bin, DC excluded */
+double efPeakFrequency(const double *psd, int nfft, double fs);
+
+/** RMS of the signal computed from the PSD, DC excluded */
+double efRmsFromPSD(const double *psd, int nfft, double fs);
+
+#endif /* ELVEFLOWSPECTRUM_H */
@@ -0,0 +1,162 @@
+/* elveFlowStats.h
+ *
+ * Incremental statistics used by the elveFlow acquisition thread.
+ * Every update is O(1) so they can run on every acquired sample.
+ *
+ */
+
+#ifndef ELVEFLOWSTATS_H
+#define ELVEFLOWSTATS_H
+
+#include <math.h>
+
+/** Mean and variance over the last N samples.
+  * Uses the sliding form of Welford's update, the oldest sample is removed
+  * as the newest one is added so the cost does not depend on N. */
+class EFSlidingWindow {
+public:
+  enum { MAX_LENGTH = 2000 };
+
+  EFSlidingWindow() { setLength(1); }
+
+  /** Changes the window length (clipped to MAX_LENGTH) and clears it */
+  void setLength(int n) {
+    if (n < 1) n = 1;
+    if (n > MAX_LENGTH) n = MAX_LENGTH;
+    _length = n;
+    clear();
+  }
+
+  void clear() {
+    _count = 0;
+    _head = 0;
+    _mean = 0.0;
+    _m2 = 0.0;
+  }
+
+  void add(double x) {
+    if (_count < _length) {
+      double delta = x - _mean;
+      _count++;
+      _mean += delta / _count;
+      _m2 += delta * (x - _mean);
+    }
+    else {
+      double old = _buffer[_head];
+      double oldMean = _mean;
+      _mean += (x - old) / _length;
+      _m2 += (x - old) * (x - _mean + old - oldMean);
+      if (_m2 < 0) _m2 = 0;   // rounding
+    }
+    _buffer[_head] = x;
+    _head = (_head + 1) % _length;
+  }
+
+  int length() const { return _length; }
+  int count() const { return _count; }
+  bool full() const { return _count == _length; }
+  double mean() const { return _mean; }
+  double variance() const { return (_count > 1) ? _m2 / (_count - 1) : 0.0; }
+  double stddev() const { return sqrt(variance()); }
+
+private:
+  double _buffer[MAX_LENGTH];
+  int _length;
+  int _count;
+  int _head;
+  double _mean;
+  double _m2;
+};
+
+/** Mean, standard deviation, min and max of all samples since the last
+  * clear(), using Welford's algorithm. */
+class EFRunningStats {
+public:
+  EFRunningStats() { clear(); }
+
+  void clear() {
+    _count = 0;
+    _mean = 0.0;
+    _m2 = 0.0;
+    _min = 0.0;
+    _max = 0.0;
+  }
+
+  void add(double x) {
+    double delta = x - _mean;
+    _count++;
+    _mean += delta / _count;
+    _m2 += delta * (x - _mean);
+    if (_count == 1 || x < _min) _min = x;
+    if (_count == 1 || x > _max) _max = x;
+  }
+
+  int count() const { return _count; }
+  double mean() const { return _mean; }
+  double variance() const { return (_count > 1) ? _m2 / (_count - 1) : 0.0; }
+  double stddev() const { return sqrt(variance()); }
+  double minimum() const { return _min; }
+  double maximum() const { return _max; }
+
+private:
+  int _count;
+  double _mean;
+  double _m2;
+  double _min;
+  double _max;
+};
+
+/** Recursive least squares fit of y = slope * x + offset with exponential
+  * forgetting, so the model follows slow changes of the operating point.
+  * The covariance trace is bounded to avoid wind-up when x does not change
+  * for a long time. */
+class EFLinearRLS {
+public:
+  enum { MAX_TRACE = 1000000 };
+
+  EFLinearRLS() { reset(); }
+
+  void reset() {
+    _slope = 0.0;
+    _offset = 0.0;
+    _p[0][0] = _p[1][1] = MAX_TRACE / 2;
+    _p[0][1] = _p[1][0] = 0.0;
+    _count = 0;
+  }
+
+  void add(double x, double y, double forget) {
+    double px0 = _p[0][0]*x + _p[0][1];     // P phi, phi = [x 1]
+    double px1 = _p[1][0]*x + _p[1][1];
+    double denom = forget + x*px0 + px1;
+    double k0 = px0 / denom, k1 = px1 / denom;
+    double err = y - (_slope*x + _offset);
+    double trace;
+
+    _slope += k0 * err;
+    _offset += k1 * err;
+    // P = (P - k phi' P) / forget, phi' P = [px0 px1] as P is symmetric
+    _p[0][0] = (_p[0][0] - k0*px0) / forget;
+    _p[0][1] = (_p[0][1] - k0*px1) / forget;
+    _p[1][0] = (_p[1][0] - k1*px0) / forget;
+    _p[1][1] = (_p[1][1] - k1*px1) / forget;
+    trace = _p[0][0] + _p[1][1];
+    if (trace > MAX_TRACE) {
+      double scale = MAX_TRACE / trace;
+      _p[0][0] *= scale; _p[0][1] *= scale;
+      _p[1][0] *= scale; _p[1][1] *= scale;
+    }
+    _count++;
+  }
+
+  int count() const { return _count; }
+  double slope() const { return _slope; }
+  double offset() const { return _offset; }
+
+private:
+  double _slope;
+  double _offset;
+  double _p[2][2];
+  int _count;
+};
+
+#endif /* ELVEFLOWSTATS_H */
@@ -0,0 +1,175 @@
+/* elveFlowSysId.cpp
+ *
+ * First order plus dead time (FOPDT) identification of the pressure to
+ * flow response, used by the elveFlow system identification mode.
+ *
+ */
+
+#include <math.h>
+
+#include "elveFlowSpectrum.h"
+#include "elveFlowSysId.h"
+
+static const double twoPi = 6.283185307179586;
+static const double radToDeg = 57.29577951308232;
+
+/** Time at which y first crosses level after index start, linearly
+  * interpolated, or -1 */
+static double crossingTime(const double *t, const double *y, int start, int n,
+                           double level, double sign)
+{
+  for (int i = start + 1; i < n; i++) {
+    if (sign * (y[i] - level) >= 0) {
+      double dy = y[i] - y[i-1];
+      double frac = (dy != 0) ? (level - y[i-1]) / dy : 1.0;
+      if (frac < 0) frac = 0;
+      if (frac > 1) frac = 1;
+      return t[i-1] + frac * (t[i] - t[i-1]);
+    }
+  }
+  return -1;
+}
+
+int efFitStep(const double *t, const double *y, int n, double tStep,
+              double ampl, efFOPDT_t *model)
+{
+  double y0 = 0.0, yInf = 0.0, dy, sign, t28, t63;
+  int nBase = 0, nFinal = 0, iStep = 0;
+
+  if (n < 10 || ampl == 0) return -1;
+  while (iStep < n && t[iStep] < tStep) {
+    y0 += y[iStep];
+    nBase++;
+    iStep++;
+  }
+  if (nBase == 0 || iStep >= n) return -1;
+  y0 /= nBase;
+  for (int i = n - n/5; i < n; i++) {
+    yInf += y[i];
+    nFinal++;
+  }
+  yInf /= nFinal;
+
+  dy = yInf - y0;
+  if (dy == 0) return -1;
+  sign = (dy > 0) ? 1.0 : -1.0;
+  t28 = crossingTime(t, y, iStep - 1, n, y0 + 0.283 * dy, sign);
+  t63 = crossingTime(t, y, iStep - 1, n, y0 + 0.632 * dy, sign);
+  if (t28 < 0 || t63 < 0) return -1;
+
+  model->gain = dy / ampl;
+  model->tau = 1.5 * (t63 - t28);
+  model->deadTime = (t63 - tStep) - model->tau;
+  if (model->deadTime < 0) model->deadTime = 0;
+  return 0;
+}
+
+int efFrequencyResponse(const double *u, const double *y, int n, double fs,
+                        double f0, double f1, int nfft, double *work,
+                        double *freq, double *mag, double *phase, int maxPoints)
+{
+  double *uRe = work, *uIm = work + nfft, *yRe = work + 2*nfft, *yIm = work + 3*nfft;
+  double uMean = 0.0, yMean = 0.0, df = fs / nfft, lastPhase = 0.0, offset = 0.0;
+  int k0, k1, step, npts = 0;
+
+  if (n < 4 || nfft < n || fs <= 0 || maxPoints < 1) return 0;
+  for (int i = 0; i < n; i++) {
+    uMean += u[i];
+    yMean += y[i];
+  }
+  uMean /= n;
+  yMean /= n;
+  for (int i = 0; i < nfft; i++) {
+    uRe[i] = (i < n) ? u[i] - uMean : 0.0;
+    yRe[i] = (i < n) ? y[i] - yMean : 0.0;
+    uIm[i] = yIm[i] = 0.0;
+  }
+  efFFT(uRe, uIm, nfft);
+  efFFT(yRe, yIm, nfft);
+
+  k0 = (int)ceil(f0 / df);
+  k1 = (int)floor(f1 / df);
+  if (k0 < 1) k0 = 1;
+  if (k1 > nfft/2) k1 = nfft/2;
+  if (k1 < k0) return 0;
+  step = (k1 - k0) / maxPoints + 1;
+
+  for (int k = k0; k <= k1 && npts < maxPoints; k += step) {
+    // H = Y U* / |U|^2
+    double uu = uRe[k]*uRe[k] + uIm[k]*uIm[k];
+    double hRe, hIm, ph;
+    if (uu <= 0) continue;
+    hRe = (yRe[k]*uRe[k] + yIm[k]*uIm[k]) / uu;
+    hIm = (yIm[k]*uRe[k] - yRe[k]*uIm[k]) / uu;
+    ph = atan2(hIm, hRe) * radToDeg;
+    // Unwrap so that the dead time shows up as a continuous phase lag
+    if (npts > 0) {
+      while (ph + offset - lastPhase > 180.0) offset -= 360.0;
+      while (ph + offset - lastPhase < -180.0) offset += 360.0;
+    }
+    freq[npts] = k * df;
+    mag[npts] = sqrt(hRe*hRe + hIm*hIm);
+    phase[npts] = ph + offset;
+    lastPhase = phase[npts];
+    npts++;
+  }
+  return npts;
+}
+
+int efFitFrequencyResponse(const double *freq, const double *mag,
+                           const double *phase, int n, efFOPDT_t *model)
+{
+  double sw = 0.0, sx = 0.0, sz = 0.0, sxx = 0.0, sxz = 0.0, a, b, num, den, det, tau;
+  double sign = 1.0;
+  int m = 0;
+
+  if (n < 3) return -1;
+  // 1/|H|^2 = 1/K^2 + (tau/K)^2 w^2, linear least squares in w^2 weighted
+  // by |H|^4 so that every point contributes with its relative error
+  for (int i = 0; i < n; i++) {
+    double w = twoPi * freq[i];
+    double x = w*w, z, wt;
+    if (mag[i] <= 0) continue;
+    z = 1.0 / (mag[i]*mag[i]);
+    wt = 1.0 / (z*z);
+    sw += wt;
+    sx += wt*x;
+    sz += wt*z;
+    sxx += wt*x*x;
+    sxz += wt*x*z;
+    m++;
+  }
+  det = sw*sxx - sx*sx;
+  if (m < 3 || det <= 0) return -1;
+  a = (sxx*sz - sx*sxz) / det;
+  b = (sw*sxz - sx*sz) / det;
+  if (a <= 0) return -1;
+  // Negative gain if the phase starts near 180 degrees
+  if (fabs(phase[0]) > 90.0) sign = -1.0;
+  model->gain = sign / sqrt(a);
+  tau = (b > 0) ? sqrt(b / a) : 0.0;
+  model->tau = tau;
+
+  // -phase - atan(w tau) = w theta, phase relative to the static phase
+  num = den = 0.0;
+  for (int i = 0; i < n; i++) {
+    double w = twoPi * freq[i];
+    double lag = -(phase[i] - ((sign < 0) ? 180.0 : 0.0)) / radToDeg - atan(w * tau);
+    num += w * lag;
+    den += w * w;
+  }
+  model->deadTime = (den > 0) ? num / den : 0.0;
+  if (model->deadTime < 0) model->deadTime = 0;
+  return 0;
+}
+
+void efModelResponse(const efFOPDT_t *model, const double *freq, int n,
+                     double *mag, double *phase)
+{
+  for (int i = 0; i < n; i++) {
+    double w = twoPi * freq[i];
+    mag[i] = fabs(model->gain) / sqrt(1.0 + w*w * model->tau*model->tau);
+    phase[i] = -(atan(w * model->tau) + w * model->deadTime) * radToDeg;
+    if (model->gain < 0) phase[i] += 180.0;
+  }
+}
@@ -0,0 +1,44 @@
+/* elveFlowSysId.h
+ *
+ * First order plus dead time (FOPDT) identification of the pressure to
+ * flow response, used by the elveFlow system identification mode.
+ *
+ *   G(s) = K exp(-theta s) / (1 + tau s)
+ *
+ */
+
+#ifndef ELVEFLOWSYSID_H
+#define ELVEFLOWSYSID_H
+
+typedef struct {
+  double gain;      // K, flow units per pressure unit
+  double deadTime;  // theta, s
+  double tau;       // time constant, s
+} efFOPDT_t;
+
+/** Fits a FOPDT model to a step response with the two point (28.3%/63.2%)
+  * method. t, y are n samples, the step of amplitude ampl is applied at
+  * tStep. The baseline is the mean before the step and the final value the
+  * mean of the last fifth of the record. Returns 0 on success, -1 if the
+  * response is too small or never reaches 63%. */
+int efFitStep(const double *t, const double *y, int n, double tStep,
+              double ampl, efFOPDT_t *model);
+
+/** Empirical frequency response y/u between f0 and f1 Hz from a record of
+  * n uniformly spaced samples at fs Hz. The record is zero padded to nfft,
+  * a power of 2 >= n. work needs 4*nfft doubles. At most maxPoints bins,
+  * evenly decimated, are returned in freq (Hz), mag and phase (degrees,
+  * unwrapped). Returns the number of points. */
+int efFrequencyResponse(const double *u, const double *y, int n, double fs,
+                        double f0, double f1, int nfft, double *work,
+                        double *freq, double *mag, double *phase, int maxPoints);
+
+/** Least squares FOPDT fit to a frequency response. Returns 0 on success */
+int efFitFrequencyResponse(const double *freq, const double *mag,
+                           const double *phase, int n, efFOPDT_t *model);
+
+/** Frequency response of a FOPDT model at n frequencies (Hz), phase in degrees */
+void efModelResponse(const efFOPDT_t *model, const double *freq, int n,
+                     double *mag, double *phase);
+
+#endif /* ELVEFLOWSYSID_H */
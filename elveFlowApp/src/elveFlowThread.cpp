@@ -0,0 +1,37 @@
+/* elveFlowThread.cpp
+ *
+ * CPU affinity of the elveFlow I/O threads.
+ *
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "elveFlowThread.h"
+
+int efSetThreadAffinity(unsigned long mask)
+{
+  if (mask == 0) return 0;
+#ifdef _WIN32
+  return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)mask) ? 0 : -1;
+#elif defined(__linux__)
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  for (unsigned i = 0; i < 8 * sizeof(mask) && i < CPU_SETSIZE; i++)
+    if ((mask >> i) & 1) CPU_SET(i, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? -1 : 0;
+#else
+  return -1;
+#endif
+}
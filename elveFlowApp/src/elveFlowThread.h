@@ -0,0 +1,16 @@
+/* elveFlowThread.h
+ *
+ * CPU affinity of the elveFlow I/O threads. EPICS sets thread priorities
+ * but not affinities, this is the operating system specific part.
+ *
+ */
+
+#ifndef ELVEFLOWTHREAD_H
+#define ELVEFLOWTHREAD_H
+
+/** Restricts the calling thread to the CPUs whose bits are set in mask,
+  * bit 0 is CPU 0. A mask of 0 leaves the thread unchanged.
+  * Returns 0 on success, -1 if the mask was refused or is not supported. */
+int efSetThreadAffinity(unsigned long mask);
+
+#endif /* ELVEFLOWTHREAD_H */
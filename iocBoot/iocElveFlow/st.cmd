@@ -7,10 +7,29 @@ elveFlowApp_registerRecordDeviceDriver pdbbase
 dbLoadTemplate("elveFlow.substitutions")
 
 ## Configure port driver
-# USBelveFlowConfig(portName)        # The name to give to this asyn port driver
+# USBelveFlowConfig(portName,       # The name to give to this asyn port driver
+#                   checkpointFile, # Control state kept across restarts, "" for none
+#                   priority,       # EPICS priority of the I/O threads, 0 for the defaults
+#                   cpuMask)        # CPUs of the I/O threads, e.g. 0x4 for CPU 2, 0 for any
 
-USBelveFlowConfig("elveFlowOB1", 1)
+USBelveFlowConfig("elveFlowOB1", "elveFlowOB1.checkpoint", 0, 0)
+
+# Several OB1s can be acquired together as one group port:
+# USBelveFlowGroupConfig(portName,   # The name of the group port
+#                        members,    # Ports of the controllers, "elveFlowOB1,elveFlowOB2"
+#                        period)     # Cycle period, s
+#USBelveFlowGroupConfig("elveFlowGroup", "elveFlowOB1", 0.01)
+#dbLoadRecords("$(ELVEFLOW)/db/elveFlowGroup.template", "P=XF11ID-ES,R=\{elveFlowGroup\},PORT=elveFlowGroup,NCH=4")
 
 #asynSetTraceMask elveFlowOB1 -1 255
 
+# The controllers initialize in parallel, iocInit waits at most this long (s)
+#var elveFlowInitTimeout 30
+
 iocInit
+
+# Time taken by each initialization phase of every controller
+#USBelveFlowInitReport
+
+# With autosave, elveFlowOB1_settings.req saves all four channels:
+#create_monitor_set("elveFlowOB1_settings.req", 30, "P=XF11ID-ES,R=\{elveFlowOB1\},R1=\{elveFlowOB1\},R2=\{elveFlowOB1-Ch2\},R3=\{elveFlowOB1-Ch3\},R4=\{elveFlowOB1-Ch4\}")